@@ -163,6 +163,46 @@ LJLIB_CF(debug_getinfo)
   return 1;  /* Return result table. */
 }
 
+/* dritchie: (fnprotoid, bytecodepos) of the frame at a level (default 1).
+** The recorder turns this into constants for frames entered on-trace.
+*/
+LJLIB_CF(debug_callsite)	LJLIB_REC(.)
+{
+  int32_t level = lj_lib_optint(L, 1, 1);
+  int32_t id, pos;
+  if (level < 1)
+    lj_err_arg(L, 1, LJ_ERR_LVLRNG);
+  if (!lj_debug_callsite(L, level, &id, &pos))
+    return 0;
+  setintV(L->top++, id);
+  setintV(L->top++, pos);
+  return 2;
+}
+
+/* dritchie: structural address of the call site at a level, up to the
+** frame of the function with prototype id 'rootid'. Returns a string, or
+** a number if the 4th argument is true. The optional 5th argument is a
+** frame cache table. See lj_debug_address().
+*/
+LJLIB_CF(debug_getaddress)
+{
+  int level = lj_lib_checkint(L, 1);
+  int hasroot = !tvisnil(lj_lib_checkany(L, 2));
+  int32_t rootid = hasroot ? lj_lib_checkint(L, 2) : 0;
+  GCtab *lc = lj_lib_checktab(L, 3);
+  int hashed = L->base+3 < L->top && tvistruecond(L->base+3);
+  GCtab *cache = L->base+4 < L->top ? lj_lib_checktabornil(L, 5) : NULL;
+  if (hashed) {
+    setnumV(L->top++,
+	    lj_debug_addresshash(L, level, rootid, hasroot, lc, cache));
+  } else {
+    setstrV(L, L->top++,
+	    lj_debug_address(L, level, rootid, hasroot, lc, cache));
+    lj_gc_check(L);
+  }
+  return 1;
+}
+
 LJLIB_CF(debug_getlocal)
 {
   int arg;
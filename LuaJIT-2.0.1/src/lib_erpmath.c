@@ -0,0 +1,713 @@
+/*
+** ERP math library.
+** dritchie: special functions and batched scoring and sampling for the
+** ERPs of the probabilistic library. Each batched call works through a
+** whole array of values, so a likelihood over N observations costs one
+** call instead of N.
+*/
+
+#include <math.h>
+
+#define lib_erpmath_c
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "lj_obj.h"
+#include "lj_gc.h"
+#include "lj_err.h"
+#include "lj_str.h"
+#include "lj_tab.h"
+#if LJ_HASFFI
+#include "lj_ctype.h"
+#include "lj_cconv.h"
+#endif
+#include "lj_lib.h"
+
+#if LJ_TARGET_POSIX
+#include <pthread.h>
+#endif
+
+#define LOG2PI	1.8378770664093453
+
+/* -- Special functions --------------------------------------------------- */
+
+/* log(n!) for n = 0 .. LFACT_TABSIZE-1, filled in once per process when
+** the first state opens the library (see erpmath_init).
+*/
+#define LFACT_TABSIZE	256
+static double lfact_tab[LFACT_TABSIZE];
+
+static void lfact_init(void)
+{
+  double s = 0.0;
+  int i;
+  lfact_tab[0] = 0.0;
+  for (i = 1; i < LFACT_TABSIZE; i++) {
+    s += log((double)i);
+    lfact_tab[i] = s;
+  }
+}
+
+/* Lanczos approximation with 14 terms (relative error below 1e-15). */
+static const double lgamma_cof[14] = {
+  57.1562356658629235, -59.5979603554754912, 14.1360979747417471,
+  -0.491913816097620199, 0.339946499848118887e-4, 0.465236289270485756e-4,
+  -0.983744753048795646e-4, 0.158088703224912494e-3,
+  -0.210264441724104883e-3, 0.217439618115212643e-3,
+  -0.164318106536763890e-3, 0.844182239838527433e-4,
+  -0.261908384015814087e-4, 0.368991826595316234e-5
+};
+
+/* log |Gamma(x)|. Small positive integers come from the table. */
+double lj_erpmath_lgamma(double x)
+{
+  double y, tmp, ser;
+  int j;
+  if (x >= 1.0 && x <= (double)LFACT_TABSIZE && x == floor(x))
+    return lfact_tab[(int)x - 1];
+  if (x < 0.5) {  /* Reflection: Gamma(x) Gamma(1-x) = pi/sin(pi x). */
+    double sn = sin(3.14159265358979323846*x);
+    if (sn == 0.0) return HUGE_VAL;
+    return log(3.14159265358979323846/fabs(sn)) - lj_erpmath_lgamma(1.0-x);
+  }
+  y = x;
+  tmp = x + 5.24218750000000000;
+  tmp = (x + 0.5)*log(tmp) - tmp;
+  ser = 0.999999999999997092;
+  for (j = 0; j < 14; j++)
+    ser += lgamma_cof[j] / ++y;
+  return tmp + log(2.5066282746310005*ser/x);
+}
+
+/* Digamma, by recurrence up to x >= 6 and then the asymptotic series. */
+double lj_erpmath_digamma(double x)
+{
+  double r = 0.0, f;
+  if (x <= 0.0) {
+    if (x == floor(x)) return -HUGE_VAL;
+    /* Reflection: psi(1-x) - psi(x) = pi cot(pi x). */
+    return lj_erpmath_digamma(1.0-x) -
+	   3.14159265358979323846/tan(3.14159265358979323846*x);
+  }
+  while (x < 6.0) {
+    r -= 1.0/x;
+    x += 1.0;
+  }
+  f = 1.0/(x*x);
+  return r + log(x) - 0.5/x -
+	 f*(1.0/12 - f*(1.0/120 - f*(1.0/252 - f*(1.0/240 - f*(1.0/132)))));
+}
+
+/* log(n!), for any real n >= 0. */
+double lj_erpmath_lfact(double n)
+{
+  if (n >= 0.0 && n < (double)LFACT_TABSIZE && n == floor(n))
+    return lfact_tab[(int)n];
+  return lj_erpmath_lgamma(n + 1.0);
+}
+
+double lj_erpmath_lbeta(double a, double b)
+{
+  return lj_erpmath_lgamma(a) + lj_erpmath_lgamma(b) - lj_erpmath_lgamma(a+b);
+}
+
+/* log of the binomial coefficient (n choose k); -inf outside 0 <= k <= n. */
+double lj_erpmath_lchoose(double n, double k)
+{
+  if (!(k >= 0.0 && k <= n))
+    return -HUGE_VAL;
+  return lj_erpmath_lfact(n) - lj_erpmath_lfact(k) - lj_erpmath_lfact(n-k);
+}
+
+/* -- Ziggurat samplers --------------------------------------------------- */
+
+static LJ_AINLINE double randu(RandomState *rs)
+{
+  union { uint64_t u64; double d; } u;
+  u.u64 = lj_math_random_step(rs);
+  return u.d - 1.0;  /* 0.0 <= d < 1.0 */
+}
+
+/* Marsaglia and Tsang's Ziggurat method, with 128 layers for the normal
+** (as laid out by Doornik, 2005) and 256 for the exponential. One step of
+** the generator gives the layer (low bits) and the position within it
+** (the other random bits). Almost all draws land inside the rectangular
+** part of their layer and cost a multiply and a compare; only the rest
+** need an exp(), or a draw from the tail.
+*/
+#define ZN_LAYERS	128
+#define ZN_R		3.442619855899		/* Start of the tail. */
+#define ZN_V		9.91256303526217e-3	/* Area of each layer. */
+#define ZE_LAYERS	256
+#define ZE_R		7.69711747013104972
+#define ZE_V		3.949659822581572e-3
+
+/* Layer edges x[i], x[i+1]/x[i], and the density at each edge. Filled in
+** once per process, like lfact_tab.
+*/
+static double zn_x[ZN_LAYERS+1], zn_ratio[ZN_LAYERS], zn_f[ZN_LAYERS+1];
+static double ze_x[ZE_LAYERS+1], ze_ratio[ZE_LAYERS], ze_f[ZE_LAYERS+1];
+
+static void ziggurat_init(void)
+{
+  int i;
+  zn_x[0] = ZN_V / exp(-0.5*ZN_R*ZN_R);
+  zn_x[1] = ZN_R;
+  for (i = 2; i < ZN_LAYERS; i++)
+    zn_x[i] = sqrt(-2.0*log(ZN_V/zn_x[i-1] + exp(-0.5*zn_x[i-1]*zn_x[i-1])));
+  zn_x[ZN_LAYERS] = 0.0;
+  for (i = 0; i <= ZN_LAYERS; i++)
+    zn_f[i] = exp(-0.5*zn_x[i]*zn_x[i]);
+  for (i = 0; i < ZN_LAYERS; i++)
+    zn_ratio[i] = zn_x[i+1] / zn_x[i];
+  ze_x[0] = ZE_V / exp(-ZE_R);
+  ze_x[1] = ZE_R;
+  for (i = 2; i < ZE_LAYERS; i++)
+    ze_x[i] = -log(ZE_V/ze_x[i-1] + exp(-ze_x[i-1]));
+  ze_x[ZE_LAYERS] = 0.0;
+  for (i = 0; i <= ZE_LAYERS; i++)
+    ze_f[i] = exp(-ze_x[i]);
+  for (i = 0; i < ZE_LAYERS; i++)
+    ze_ratio[i] = ze_x[i+1] / ze_x[i];
+}
+
+/* The 52 random bits of a generator step. */
+#define ZIG_BITS(rs)	(lj_math_random_step(rs) & U64x(000fffff,ffffffff))
+
+static double zig_exponential(RandomState *rs)
+{
+  double base = 0.0;
+  for (;;) {
+    uint64_t r = ZIG_BITS(rs);
+    int i = (int)(r & (ZE_LAYERS-1));
+    double u = (double)(int64_t)(r >> 8) * (1.0/17592186044416.0);  /* 2^44 */
+    double x = u*ze_x[i];
+    if (u < ze_ratio[i])
+      return base + x;
+    if (i == 0)  /* Tail: memoryless, so start over past ZE_R. */
+      base += ZE_R;
+    else if (ze_f[i+1] + randu(rs)*(ze_f[i] - ze_f[i+1]) < exp(-x))
+      return base + x;
+  }
+}
+
+static double zig_normal(RandomState *rs)
+{
+  for (;;) {
+    uint64_t r = ZIG_BITS(rs);
+    int i = (int)(r & (ZN_LAYERS-1));
+    double u = 2.0*(double)(int64_t)(r >> 7)*(1.0/35184372088832.0) - 1.0;  /* 2^45 */
+    double x = u*zn_x[i];
+    if (fabs(u) < zn_ratio[i])
+      return x;
+    if (i == 0) {  /* Tail, by Marsaglia's method. */
+      double y;
+      do {
+	x = zig_exponential(rs) / ZN_R;
+	y = zig_exponential(rs);
+      } while (y+y < x*x);
+      return u < 0.0 ? -(ZN_R + x) : ZN_R + x;
+    }
+    if (zn_f[i+1] + randu(rs)*(zn_f[i] - zn_f[i+1]) < exp(-0.5*x*x))
+      return x;
+  }
+}
+
+double lj_erpmath_gaussian(RandomState *rs, double mu, double sigma)
+{
+  return mu + sigma*zig_normal(rs);
+}
+
+double lj_erpmath_exponential(RandomState *rs, double rate)
+{
+  return zig_exponential(rs) / rate;
+}
+
+/* Marsaglia and Tsang's method, on top of the Ziggurat normal. Shapes
+** a < 1 are boosted to 1+a and scaled by U^(1/a) = exp(-E/a).
+*/
+double lj_erpmath_gamma(RandomState *rs, double a, double b)
+{
+  double x, v, u, d, c;
+  if (a < 1.0)
+    return lj_erpmath_gamma(rs, 1.0+a, b) * exp(-zig_exponential(rs)/a);
+  d = a - 1.0/3.0;
+  c = 1.0/sqrt(9.0*d);
+  for (;;) {
+    do {
+      x = zig_normal(rs);
+      v = 1.0 + c*x;
+    } while (v <= 0.0);
+    v = v*v*v;
+    u = randu(rs);
+    if (u < 1.0 - 0.0331*x*x*x*x || log(u) < 0.5*x*x + d*(1.0 - v + log(v)))
+      return b*d*v;
+  }
+}
+
+double lj_erpmath_beta(RandomState *rs, double a, double b)
+{
+  double x = lj_erpmath_gamma(rs, a, 1.0);
+  return x / (x + lj_erpmath_gamma(rs, b, 1.0));
+}
+
+/* -- ERP kernels --------------------------------------------------------- */
+
+/* The formulas below are the ones in erp.lua, so a batched score or
+** sample agrees with the scalar one (and a stream gives the same samples).
+** Loop-invariant terms are hoisted out of the loops, which reduce to sums.
+*/
+
+static double erp_binomial_sample(RandomState *rs, double p, double n)
+{
+  double k = 0.0, i;
+  while (n > 10.0) {
+    double a = 1.0 + floor(n/2.0);
+    double b = 1.0 + n - a;
+    double x = lj_erpmath_beta(rs, a, b);
+    if (x >= p) {
+      n = a - 1.0;
+      p = p / x;
+    } else {
+      k += a;
+      n = b - 1.0;
+      p = (p - x) / (1.0 - x);
+    }
+  }
+  for (i = 1.0; i <= n; i++)
+    if (randu(rs) < p) k++;
+  return k;
+}
+
+static double erp_poisson_sample(RandomState *rs, double mu)
+{
+  double k = 0.0, emu, p;
+  while (mu > 10.0) {
+    double m = 7.0/8.0*mu;
+    double x = lj_erpmath_gamma(rs, m, 1.0);
+    if (x > mu)
+      return k + erp_binomial_sample(rs, mu/x, m-1.0);
+    mu -= x;
+    k++;
+  }
+  emu = exp(-mu);
+  p = 1.0;
+  while (p > emu) {
+    p *= randu(rs);
+    k++;
+  }
+  return k - 1.0;
+}
+
+static double erp_binomial_logprob(double s, double p, double n)
+{
+  double lp;
+  if (!(s >= 0.0 && s <= n))
+    return -HUGE_VAL;
+  lp = lj_erpmath_lchoose(n, s);
+  /* Skip zero-count terms: 0*log(0) would be NaN at p = 0 or 1. */
+  if (s > 0.0) lp += s*log(p);
+  if (s < n) lp += (n-s)*log(1.0-p);
+  return lp;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Get the values of an array argument: a Lua table (1..n) or an FFI
+** double array or pointer. Table values are copied to the temp buffer,
+** so nothing that can allocate may run while the result is in use.
+** The length is taken from argument narg+1, or the table if that is nil.
+*/
+static const double *erpmath_checkvals(lua_State *L, int narg, int32_t *np)
+{
+  TValue *o = L->base + narg-1;
+  int32_t i, n;
+  double *p;
+  if (o >= L->top)
+    lj_err_arg(L, narg, LJ_ERR_NOVAL);
+  if (tvistab(o)) {
+    GCtab *t = tabV(o);
+    n = lj_lib_optint(L, narg+1, (int32_t)lj_tab_len(t));
+    p = (double *)lj_str_needbuf(L, &G(L)->tmpbuf, (MSize)n*sizeof(double));
+    for (i = 0; i < n; i++) {
+      cTValue *v = lj_tab_getint(t, i+1);
+      if (!v || !tvisnumber(v))
+	lj_err_arg(L, narg, LJ_ERR_BADVAL);
+      p[i] = numberVnum(v);
+    }
+#if LJ_HASFFI
+  } else if (tviscdata(o)) {
+    CTState *cts = ctype_cts(L);
+    CTypeID id = lj_ctype_intern(cts, CTINFO(CT_PTR, CTALIGN_PTR|CTID_DOUBLE),
+				 CTSIZE_PTR);
+    n = lj_lib_checkint(L, narg+1);
+    lj_cconv_ct_tv(cts, ctype_get(cts, id), (uint8_t *)&p, o, CCF_ARG(narg));
+#endif
+  } else {
+    lj_err_argt(L, narg, LUA_TTABLE);
+  }
+  *np = n < 0 ? 0 : n;
+  return p;
+}
+
+/* Get where to put n samples: the FFI double array given as argument
+** narg, or else the table given there (or a new one), which gets its
+** values from the temp buffer when the samples are done (see
+** erpmath_putsamples). Leaves the array to return on the stack top.
+*/
+static double *erpmath_sampledest(lua_State *L, int narg, int32_t n, GCtab **tp)
+{
+  TValue *o = L->base + narg-1;
+  GCtab *t;
+  if (n < 0)
+    lj_err_arg(L, 2, LJ_ERR_BADVAL);
+#if LJ_HASFFI
+  if (o < L->top && tviscdata(o)) {
+    CTState *cts = ctype_cts(L);
+    CTypeID id = lj_ctype_intern(cts, CTINFO(CT_PTR, CTALIGN_PTR|CTID_DOUBLE),
+				 CTSIZE_PTR);
+    double *p;
+    lj_cconv_ct_tv(cts, ctype_get(cts, id), (uint8_t *)&p, o, CCF_ARG(narg));
+    copyTV(L, L->top++, o);
+    *tp = NULL;
+    return p;
+  }
+#endif
+  if (o < L->top && tvistab(o)) {
+    t = tabV(o);
+    if (t->asize < (uint32_t)n+1)
+      lj_tab_reasize(L, t, (uint32_t)n+1);
+  } else if (o >= L->top || tvisnil(o)) {
+    lj_gc_check(L);
+    t = lj_tab_new(L, (uint32_t)n+1, 0);
+  } else {
+    lj_err_argt(L, narg, LUA_TTABLE);
+  }
+  settabV(L, L->top++, t);
+  *tp = t;
+  return (double *)lj_str_needbuf(L, &G(L)->tmpbuf, (MSize)n*sizeof(double));
+}
+
+static void erpmath_putsamples(GCtab *t, const double *p, int32_t n)
+{
+  int32_t i;
+  if (t) {
+    for (i = 0; i < n; i++)
+      setnumV(arrayslot(t, i+1), p[i]);
+  }
+}
+
+/* ------------------------------------------------------------------------ */
+
+#define LJLIB_MODULE_erpmath
+
+/* Special functions (recorded as calls by the JIT). */
+
+LJLIB_CF(erpmath_lgamma)	LJLIB_REC(math_htrig IRCALL_lj_erpmath_lgamma)
+{
+  setnumV(L->top++, lj_erpmath_lgamma(lj_lib_checknum(L, 1)));
+  return 1;
+}
+
+LJLIB_CF(erpmath_digamma)	LJLIB_REC(math_htrig IRCALL_lj_erpmath_digamma)
+{
+  setnumV(L->top++, lj_erpmath_digamma(lj_lib_checknum(L, 1)));
+  return 1;
+}
+
+LJLIB_CF(erpmath_lfact)		LJLIB_REC(math_htrig IRCALL_lj_erpmath_lfact)
+{
+  setnumV(L->top++, lj_erpmath_lfact(lj_lib_checknum(L, 1)));
+  return 1;
+}
+
+LJLIB_CF(erpmath_lbeta)		LJLIB_REC(erpmath_call2 IRCALL_lj_erpmath_lbeta)
+{
+  double a = lj_lib_checknum(L, 1);
+  setnumV(L->top++, lj_erpmath_lbeta(a, lj_lib_checknum(L, 2)));
+  return 1;
+}
+
+LJLIB_CF(erpmath_lchoose)	LJLIB_REC(erpmath_call2 IRCALL_lj_erpmath_lchoose)
+{
+  double n = lj_lib_checknum(L, 1);
+  setnumV(L->top++, lj_erpmath_lchoose(n, lj_lib_checknum(L, 2)));
+  return 1;
+}
+
+/* Samplers: erpmath.gaussian(stream, mu, sigma), exponential(stream, rate),
+** gamma(stream, a, b) and beta(stream, a, b) draw one value from the stream
+** (see math.newrandom). The JIT records them as calls.
+*/
+
+LJLIB_CF(erpmath_gaussian)	LJLIB_REC(erpmath_draw IRCALL_lj_erpmath_gaussian)
+{
+  RandomState *rs = lj_math_checkstream(L, 1);
+  double mu = lj_lib_checknum(L, 2);
+  setnumV(L->top++, lj_erpmath_gaussian(rs, mu, lj_lib_checknum(L, 3)));
+  return 1;
+}
+
+LJLIB_CF(erpmath_exponential)	LJLIB_REC(erpmath_draw IRCALL_lj_erpmath_exponential)
+{
+  RandomState *rs = lj_math_checkstream(L, 1);
+  setnumV(L->top++, lj_erpmath_exponential(rs, lj_lib_checknum(L, 2)));
+  return 1;
+}
+
+LJLIB_CF(erpmath_gamma)		LJLIB_REC(erpmath_draw IRCALL_lj_erpmath_gamma)
+{
+  RandomState *rs = lj_math_checkstream(L, 1);
+  double a = lj_lib_checknum(L, 2);
+  setnumV(L->top++, lj_erpmath_gamma(rs, a, lj_lib_checknum(L, 3)));
+  return 1;
+}
+
+LJLIB_CF(erpmath_beta)		LJLIB_REC(erpmath_draw IRCALL_lj_erpmath_beta)
+{
+  RandomState *rs = lj_math_checkstream(L, 1);
+  double a = lj_lib_checknum(L, 2);
+  setnumV(L->top++, lj_erpmath_beta(rs, a, lj_lib_checknum(L, 3)));
+  return 1;
+}
+
+/* Batched ERP kernels. */
+
+/* erpmath.<erp>_logprob(vals [, n], params...): summed log probability of
+** the values under the ERP. erpmath.<erp>_sample(stream, n, params...
+** [, dest]): n samples drawn from the stream (see math.newrandom), in dest
+** (a table or FFI double array) or a new table, which is returned.
+*/
+
+LJLIB_CF(erpmath_flip_logprob)
+{
+  int32_t i, n, ones = 0;
+  const double *x = erpmath_checkvals(L, 1, &n);
+  double p = lj_lib_checknum(L, 3), lp = 0.0;
+  for (i = 0; i < n; i++)
+    ones += (x[i] != 0.0);
+  /* Only count outcomes that occur, so p = 0 or 1 gives 0 or -inf, not NaN. */
+  if (ones > 0) lp += ones*log(p);
+  if (n-ones > 0) lp += (n-ones)*log(1.0-p);
+  setnumV(L->top++, lp);
+  return 1;
+}
+
+LJLIB_CF(erpmath_flip_sample)
+{
+  RandomState *rs = lj_math_checkstream(L, 1);
+  int32_t i, n = lj_lib_checkint(L, 2);
+  double p = lj_lib_checknum(L, 3);
+  GCtab *t;
+  double *x = erpmath_sampledest(L, 4, n, &t);
+  for (i = 0; i < n; i++)
+    x[i] = randu(rs) < p ? 1.0 : 0.0;
+  erpmath_putsamples(t, x, n);
+  return 1;
+}
+
+LJLIB_CF(erpmath_uniform_logprob)
+{
+  int32_t i, n;
+  const double *x = erpmath_checkvals(L, 1, &n);
+  double lo = lj_lib_checknum(L, 3), hi = lj_lib_checknum(L, 4);
+  double lp = -n*log(hi - lo);
+  for (i = 0; i < n; i++)
+    if (x[i] < lo || x[i] > hi) { lp = -HUGE_VAL; break; }
+  setnumV(L->top++, lp);
+  return 1;
+}
+
+LJLIB_CF(erpmath_uniform_sample)
+{
+  RandomState *rs = lj_math_checkstream(L, 1);
+  int32_t i, n = lj_lib_checkint(L, 2);
+  double lo = lj_lib_checknum(L, 3), hi = lj_lib_checknum(L, 4);
+  GCtab *t;
+  double *x = erpmath_sampledest(L, 5, n, &t);
+  for (i = 0; i < n; i++) {
+    double u = randu(rs);
+    x[i] = (1.0-u)*lo + u*hi;
+  }
+  erpmath_putsamples(t, x, n);
+  return 1;
+}
+
+LJLIB_CF(erpmath_gaussian_logprob)
+{
+  int32_t i, n;
+  const double *x = erpmath_checkvals(L, 1, &n);
+  double mu = lj_lib_checknum(L, 3), sigma = lj_lib_checknum(L, 4);
+  double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+  /* Four independent sums, so the loop can use packed arithmetic. */
+  for (i = 0; i+3 < n; i += 4) {
+    double d0 = x[i]-mu, d1 = x[i+1]-mu, d2 = x[i+2]-mu, d3 = x[i+3]-mu;
+    s0 += d0*d0; s1 += d1*d1; s2 += d2*d2; s3 += d3*d3;
+  }
+  for (; i < n; i++) {
+    double d = x[i]-mu;
+    s0 += d*d;
+  }
+  setnumV(L->top++, -0.5*(n*(LOG2PI + 2.0*log(sigma)) +
+			  ((s0+s1)+(s2+s3))/(sigma*sigma)));
+  return 1;
+}
+
+LJLIB_CF(erpmath_gaussian_sample)
+{
+  RandomState *rs = lj_math_checkstream(L, 1);
+  int32_t i, n = lj_lib_checkint(L, 2);
+  double mu = lj_lib_checknum(L, 3), sigma = lj_lib_checknum(L, 4);
+  GCtab *t;
+  double *x = erpmath_sampledest(L, 5, n, &t);
+  for (i = 0; i < n; i++)
+    x[i] = lj_erpmath_gaussian(rs, mu, sigma);
+  erpmath_putsamples(t, x, n);
+  return 1;
+}
+
+LJLIB_CF(erpmath_gamma_logprob)
+{
+  int32_t i, n;
+  const double *x = erpmath_checkvals(L, 1, &n);
+  double a = lj_lib_checknum(L, 3), b = lj_lib_checknum(L, 4);
+  double slog = 0.0, sum = 0.0;
+  for (i = 0; i < n; i++) {
+    slog += log(x[i]);
+    sum += x[i];
+  }
+  setnumV(L->top++, (a-1.0)*slog - sum/b - n*(lj_erpmath_lgamma(a) + a*log(b)));
+  return 1;
+}
+
+LJLIB_CF(erpmath_gamma_sample)
+{
+  RandomState *rs = lj_math_checkstream(L, 1);
+  int32_t i, n = lj_lib_checkint(L, 2);
+  double a = lj_lib_checknum(L, 3), b = lj_lib_checknum(L, 4);
+  GCtab *t;
+  double *x = erpmath_sampledest(L, 5, n, &t);
+  for (i = 0; i < n; i++)
+    x[i] = lj_erpmath_gamma(rs, a, b);
+  erpmath_putsamples(t, x, n);
+  return 1;
+}
+
+LJLIB_CF(erpmath_beta_logprob)
+{
+  int32_t i, n;
+  const double *x = erpmath_checkvals(L, 1, &n);
+  double a = lj_lib_checknum(L, 3), b = lj_lib_checknum(L, 4);
+  double slog = 0.0, slog1 = 0.0;
+  double logbeta = lj_erpmath_lbeta(a, b);
+  for (i = 0; i < n; i++) {
+    if (!(x[i] > 0.0 && x[i] < 1.0)) {
+      setnumV(L->top++, -HUGE_VAL);
+      return 1;
+    }
+    slog += log(x[i]);
+    slog1 += log(1.0-x[i]);
+  }
+  setnumV(L->top++, (a-1.0)*slog + (b-1.0)*slog1 - n*logbeta);
+  return 1;
+}
+
+LJLIB_CF(erpmath_beta_sample)
+{
+  RandomState *rs = lj_math_checkstream(L, 1);
+  int32_t i, n = lj_lib_checkint(L, 2);
+  double a = lj_lib_checknum(L, 3), b = lj_lib_checknum(L, 4);
+  GCtab *t;
+  double *x = erpmath_sampledest(L, 5, n, &t);
+  for (i = 0; i < n; i++)
+    x[i] = lj_erpmath_beta(rs, a, b);
+  erpmath_putsamples(t, x, n);
+  return 1;
+}
+
+LJLIB_CF(erpmath_binomial_logprob)
+{
+  int32_t i, n;
+  const double *x = erpmath_checkvals(L, 1, &n);
+  double p = lj_lib_checknum(L, 3), trials = lj_lib_checknum(L, 4);
+  double lp = 0.0;
+  for (i = 0; i < n; i++)
+    lp += erp_binomial_logprob(x[i], p, trials);
+  setnumV(L->top++, lp);
+  return 1;
+}
+
+LJLIB_CF(erpmath_binomial_sample)
+{
+  RandomState *rs = lj_math_checkstream(L, 1);
+  int32_t i, n = lj_lib_checkint(L, 2);
+  double p = lj_lib_checknum(L, 3), trials = lj_lib_checknum(L, 4);
+  GCtab *t;
+  double *x = erpmath_sampledest(L, 5, n, &t);
+  for (i = 0; i < n; i++)
+    x[i] = erp_binomial_sample(rs, p, trials);
+  erpmath_putsamples(t, x, n);
+  return 1;
+}
+
+LJLIB_CF(erpmath_poisson_logprob)
+{
+  int32_t i, n;
+  const double *x = erpmath_checkvals(L, 1, &n);
+  double mu = lj_lib_checknum(L, 3);
+  double sum = 0.0, slnfact = 0.0;
+  for (i = 0; i < n; i++) {
+    sum += x[i];
+    slnfact += lj_erpmath_lfact(x[i]);
+  }
+  setnumV(L->top++, sum*log(mu) - n*mu - slnfact);
+  return 1;
+}
+
+LJLIB_CF(erpmath_poisson_sample)
+{
+  RandomState *rs = lj_math_checkstream(L, 1);
+  int32_t i, n = lj_lib_checkint(L, 2);
+  double mu = lj_lib_checknum(L, 3);
+  GCtab *t;
+  double *x = erpmath_sampledest(L, 4, n, &t);
+  for (i = 0; i < n; i++)
+    x[i] = erp_poisson_sample(rs, mu);
+  erpmath_putsamples(t, x, n);
+  return 1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+#include "lj_libdef.h"
+
+/* The tables are shared by all states. Worker states of parallel.run open
+** the library while other threads may be sampling from them, so they must
+** be written exactly once.
+*/
+static void erpmath_init(void)
+{
+  lfact_init();
+  ziggurat_init();
+}
+
+#if LJ_TARGET_POSIX
+static pthread_once_t erpmath_once = PTHREAD_ONCE_INIT;
+#endif
+
+LUALIB_API int luaopen_erpmath(lua_State *L)
+{
+#if LJ_TARGET_POSIX
+  pthread_once(&erpmath_once, erpmath_init);
+#else
+  {
+    static int erpmath_ready = 0;  /* No threads without POSIX. */
+    if (!erpmath_ready) { erpmath_init(); erpmath_ready = 1; }
+  }
+#endif
+  LJ_LIB_REG(L, LUA_ERPMATHLIBNAME, erpmath);
+  return 1;
+}
@@ -26,6 +26,8 @@ static const luaL_Reg lj_lib_load[] = {
   { LUA_DBLIBNAME,	luaopen_debug },
   { LUA_BITLIBNAME,	luaopen_bit },
   { LUA_JITLIBNAME,	luaopen_jit },
+  { LUA_PARALLELLIBNAME,	luaopen_parallel },
+  { LUA_ERPMATHLIBNAME,	luaopen_erpmath },
   { NULL,		NULL }
 };
 
@@ -13,6 +13,9 @@
 #include "lualib.h"
 
 #include "lj_obj.h"
+#include "lj_err.h"
+#include "lj_str.h"
+#include "lj_ff.h"
 #include "lj_lib.h"
 #include "lj_vm.h"
 
@@ -214,6 +217,131 @@ LJLIB_CF(math_randomseed)
   return 0;
 }
 
+/* dritchie: Generator streams. A stream is another closure of math.random
+** with its own RandomState upvalue. It is called just like math.random, and
+** the JIT records it the same way (calls are specialized to the closure).
+*/
+
+/* Get the state of the stream o, or NULL if o is not a stream. */
+RandomState *lj_math_streamstate(cTValue *o)
+{
+  GCfunc *fn;
+  RandomState *rs;
+  if (!tvisfunc(o))
+    return NULL;
+  fn = funcV(o);
+  if (!(isffunc(fn) && fn->c.ffid == FF_math_random))
+    return NULL;
+  rs = (RandomState *)(uddata(udataV(&fn->c.upvalue[0])));
+  if (LJ_UNLIKELY(!rs->valid)) random_init(rs, 0.0);
+  return rs;
+}
+
+/* Get the state of a stream (or of math.random itself). */
+RandomState *lj_math_checkstream(lua_State *L, int narg)
+{
+  RandomState *rs;
+  lj_lib_checkfunc(L, narg);
+  rs = lj_math_streamstate(L->base+narg-1);
+  if (!rs)
+    lj_err_argtype(L, narg, "random stream");
+  return rs;
+}
+
+/* Push a new stream and return its (uninitialized) state. */
+static RandomState *random_newstream(lua_State *L)
+{
+  RandomState *rs = (RandomState *)lua_newuserdata(L, sizeof(RandomState));
+  rs->valid = 0;
+  lj_lib_pushcc(L, lj_cf_math_random, FF_math_random, 1);
+  return rs;
+}
+
+/* Seed a new state from the output of another generator. The parent
+** advances, so repeated splits give different streams.
+*/
+static void random_split(RandomState *rs, RandomState *parent)
+{
+  uint32_t r = 0x11090601;  /* 64-k[i] as four 8 bit constants. */
+  int i;
+  for (i = 0; i < 4; i++) {
+    uint64_t m = (uint64_t)1 << (r&255);
+    uint64_t z = lj_math_random_step(parent) << 12;
+    z ^= lj_math_random_step(parent) & U64x(000fffff,ffffffff);
+    r >>= 8;
+    if (z < m) z += m;  /* Ensure k[i] MSB of gen[i] are non-zero. */
+    rs->gen[i] = z;
+  }
+  rs->valid = 1;
+  for (i = 0; i < 10; i++)
+    lj_math_random_step(rs);
+}
+
+/* math.newrandom([seed]): new stream, seeded like math.randomseed, or from
+** a string returned by math.randomstate, or else split off math.random.
+*/
+LJLIB_PUSH(top-2)  /* Upvalue holds userdata with RandomState. */
+LJLIB_CF(math_newrandom)
+{
+  RandomState *global = (RandomState *)(uddata(udataV(lj_lib_upvalue(L, 1))));
+  RandomState *rs;
+  if (L->base < L->top && tvisstr(L->base)) {
+    GCstr *s = strV(L->base);
+    const char *p = strdata(s);
+    int i, j;
+    if (s->len != 64) goto badstate;
+    rs = random_newstream(L);
+    for (i = 0; i < 4; i++) {
+      uint64_t z = 0;
+      for (j = 0; j < 16; j++, p++) {
+	int c = *p;
+	if (c >= '0' && c <= '9') c -= '0';
+	else if (c >= 'a' && c <= 'f') c -= 'a'-10;
+	else goto badstate;
+	z = (z << 4) | (uint64_t)c;
+      }
+      rs->gen[i] = z;
+    }
+    rs->valid = 1;
+  } else if (L->base < L->top && !tvisnil(L->base)) {
+    rs = random_newstream(L);
+    random_init(rs, lj_lib_checknum(L, 1));
+  } else {
+    if (LJ_UNLIKELY(!global->valid)) random_init(global, 0.0);
+    rs = random_newstream(L);
+    random_split(rs, global);
+  }
+  return 1;
+badstate:
+  lj_err_arg(L, 1, LJ_ERR_BADVAL);
+  return 0;
+}
+
+/* math.splitrandom(stream): new stream split off the given one. */
+LJLIB_CF(math_splitrandom)
+{
+  RandomState *parent = lj_math_checkstream(L, 1);
+  random_split(random_newstream(L), parent);
+  return 1;
+}
+
+/* math.randomstate(stream): the state of a stream as a string, which
+** math.newrandom turns back into a stream (e.g. in another Lua state).
+*/
+LJLIB_CF(math_randomstate)
+{
+  RandomState *rs = lj_math_checkstream(L, 1);
+  char buf[64];
+  int i, j;
+  for (i = 0; i < 4; i++) {
+    uint64_t z = rs->gen[i];
+    for (j = 15; j >= 0; j--, z >>= 4)
+      buf[i*16+j] = "0123456789abcdef"[(int)(z & 15)];
+  }
+  setstrV(L, L->top++, lj_str_new(L, buf, 64));
+  return 1;
+}
+
 /* ------------------------------------------------------------------------ */
 
 #include "lj_libdef.h"
@@ -0,0 +1,150 @@
+/*
+** Parallel library.
+** dritchie: runs a Lua chunk on several OS threads at once, each in its own
+** lua_State. The states share nothing, so all data goes in and out as strings.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#define lib_parallel_c
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "lj_obj.h"
+#include "lj_err.h"
+#include "lj_tab.h"
+#include "lj_lib.h"
+
+#if LJ_TARGET_POSIX
+#include <pthread.h>
+#endif
+
+/* ------------------------------------------------------------------------ */
+
+#define LJLIB_MODULE_parallel
+
+/* One call of the chunk. The input strings belong to the calling state,
+** which keeps them alive until all threads are joined. The result (or
+** error message) is malloc'ed by the thread.
+*/
+typedef struct ParallelJob {
+  const char *chunk;
+  size_t chunklen;
+  const char *arg;
+  size_t arglen;
+  char *res;
+  size_t reslen;
+  int ok;
+  int started;
+} ParallelJob;
+
+static void *parallel_thread(void *ud)
+{
+  ParallelJob *job = (ParallelJob *)ud;
+  lua_State *L = luaL_newstate();
+  const char *s;
+  if (L == NULL)
+    return NULL;  /* No result means out of memory. */
+  luaL_openlibs(L);
+  if (luaL_loadbuffer(L, job->chunk, job->chunklen, "=parallel") == 0) {
+    lua_pushlstring(L, job->arg, job->arglen);
+    if (lua_pcall(L, 1, 1, 0) == 0) {
+      job->ok = lua_isstring(L, -1);
+      if (!job->ok)
+	lua_pushliteral(L, "parallel chunk must return a string");
+    }
+  }
+  if (!lua_isstring(L, -1))
+    lua_pushliteral(L, "(error object is not a string)");
+  s = lua_tostring(L, -1);
+  job->reslen = lua_objlen(L, -1);
+  job->res = (char *)malloc(job->reslen + 1);
+  if (job->res)
+    memcpy(job->res, s, job->reslen);
+  else
+    job->ok = 0;
+  lua_close(L);
+  return NULL;
+}
+
+/* parallel.run(chunk, args): call the chunk once for every string in the
+** array args, each call on its own thread and in a new state, and return
+** the array of the strings they return. If any call fails, its error is
+** raised after all threads have finished.
+*/
+LJLIB_CF(parallel_run)
+{
+#if LJ_TARGET_POSIX
+  GCstr *chunk = lj_lib_checkstr(L, 1);
+  GCtab *args = lj_lib_checktab(L, 2);
+  int32_t i, n = (int32_t)lj_tab_len(args);
+  ParallelJob *jobs;
+  pthread_t *threads;
+  ParallelJob *failed = NULL;
+  for (i = 1; i <= n; i++) {
+    cTValue *o = lj_tab_getint(args, i);
+    if (!o || !tvisstr(o))
+      lj_err_arg(L, 2, LJ_ERR_BADVAL);
+  }
+  jobs = (ParallelJob *)calloc((size_t)n+1, sizeof(ParallelJob));
+  threads = (pthread_t *)calloc((size_t)n+1, sizeof(pthread_t));
+  if (!jobs || !threads) {
+    free(jobs); free(threads);
+    lj_err_mem(L);
+  }
+  for (i = 0; i < n; i++) {
+    GCstr *arg = strV(lj_tab_getint(args, i+1));
+    jobs[i].chunk = strdata(chunk);
+    jobs[i].chunklen = chunk->len;
+    jobs[i].arg = strdata(arg);
+    jobs[i].arglen = arg->len;
+    if (pthread_create(&threads[i], NULL, parallel_thread, &jobs[i]) == 0)
+      jobs[i].started = 1;
+    else
+      parallel_thread(&jobs[i]);  /* Out of threads: run it on this one. */
+  }
+  for (i = 0; i < n; i++)
+    if (jobs[i].started)
+      pthread_join(threads[i], NULL);
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    if (jobs[i].ok) {
+      lua_pushlstring(L, jobs[i].res, jobs[i].reslen);
+      lua_rawseti(L, -2, i+1);
+    } else if (!failed) {
+      failed = &jobs[i];
+    }
+  }
+  if (failed) {
+    if (failed->res)
+      lua_pushlstring(L, failed->res, failed->reslen);
+    else
+      lua_pushstring(L, err2msg(LJ_ERR_ERRMEM));
+  }
+  for (i = 0; i < n; i++)
+    free(jobs[i].res);
+  free(jobs);
+  free(threads);
+  if (failed)
+    lua_error(L);
+  return 1;
+#else
+  lj_err_callermsg(L, "threads are not supported on this platform");
+  return 0;
+#endif
+}
+
+/* ------------------------------------------------------------------------ */
+
+#include "lj_libdef.h"
+
+LUALIB_API int luaopen_parallel(lua_State *L)
+{
+  LJ_LIB_REG(L, LUA_PARALLELLIBNAME, parallel);
+  return 1;
+}
+
@@ -7,6 +7,7 @@
 #define LUA_CORE
 
 #include "lj_obj.h"
+#include "lj_gc.h"
 #include "lj_err.h"
 #include "lj_debug.h"
 #include "lj_str.h"
@@ -547,6 +548,249 @@ LUA_API int lua_getstack(lua_State *L, int level, lua_Debug *ar)
   }
 }
 
+/* -- Structural addresses ------------------------------------------------ */
+
+/* dritchie: the structural address of a random choice is the chain of
+** (fnprotoid, bytecodepos, loopcount) triples for all frames between the
+** root frame of the current execution trace and the current call site.
+*/
+
+/* Max. length of a formatted "fnprotoid:bytecodepos:loopcount|" triple. */
+#define ADDR_MAXFMT	(3*LJ_STR_INTBUF+3)
+
+/* Collect (fnprotoid, bytecodepos) for the frames from 'level' down to and
+** including the first frame whose prototype id matches rootid. The pairs
+** are stored in the temp buffer, innermost frame first. Levels are counted
+** exactly like lj_debug_frame() does.
+*/
+static MSize debug_addrframes(lua_State *L, int level, int32_t rootid,
+			      int hasroot)
+{
+  SBuf *sb = &G(L)->tmpbuf;
+  cTValue *frame, *nextframe, *bot = tvref(L->stack);
+  int last = 1;
+  MSize n = 0;
+  for (nextframe = frame = L->base-1; frame > bot; ) {
+    if (frame_gc(frame) == obj2gco(L))
+      level++;  /* Skip dummy frames. See lj_meta_call(). */
+    if (level <= 0 && level < last) {
+      GCfunc *fn = frame_func(frame);
+      int32_t *fr;
+      int32_t id = (int32_t)(intptr_t)funcproto(fn);
+      last = level;
+      fr = (int32_t *)lj_str_needbuf(L, sb, (n+1)*2*sizeof(int32_t));
+      fr[2*n] = id;
+      fr[2*n+1] = (int32_t)debug_framepc(L, fn,
+				   nextframe == frame ? NULL : nextframe);
+      n++;
+      if (hasroot && id == rootid)
+	break;
+    }
+    level--;
+    nextframe = frame;
+    if (frame_islua(frame)) {
+      frame = frame_prevl(frame);
+    } else {
+      if (frame_isvarg(frame))
+	level++;  /* Skip vararg pseudo-frame. */
+      frame = frame_prevd(frame);
+    }
+  }
+  return n;
+}
+
+/* Get (fnprotoid, bytecodepos) of the frame at a level. Returns the frame
+** or NULL if the level is out of range.
+*/
+cTValue *lj_debug_callsite(lua_State *L, int level, int32_t *id, int32_t *pos)
+{
+  int size;
+  cTValue *frame = lj_debug_frame(L, level, &size);
+  if (frame) {
+    GCfunc *fn = frame_func(frame);
+    *id = (int32_t)(intptr_t)funcproto(fn);
+    *pos = (int32_t)debug_framepc(L, fn, size ? frame+size : NULL);
+  }
+  return frame;
+}
+
+/* Append an integer to a string buffer. */
+static char *debug_addrint(char *p, int32_t k)
+{
+  char buf[LJ_STR_INTBUF];
+  char *q = lj_str_bufint(buf, k);
+  MSize len = (MSize)(buf+LJ_STR_INTBUF-q);
+  memcpy(p, q, len);
+  return p+len;
+}
+
+/* An optional frame cache remembers the frames seen by the last address
+** computation, from the root frame up, as (fnprotoid, bytecodepos, prefix)
+** triples. 'prefix' is the address up to and including that frame (string
+** or hash). Slot 1 holds the number of valid triples: all but the innermost
+** frame, since bumping its loop counter invalidates its prefix. Prefixes of
+** outer frames are a function of the (fnprotoid, bytecodepos) pairs below
+** them, so they can be reused as long as those still match. The owner must
+** clear the cache whenever it clears its loop counters.
+*/
+#define ADDRCACHE_SLOT(d, k)	((int32_t)(2 + 3*(d) + (k)))
+
+/* Number of leading frames (from the root) that match the frame cache. */
+static MSize debug_addrcachehit(GCtab *cache, const int32_t *fr, MSize n)
+{
+  cTValue *tv = lj_tab_getint(cache, 1);
+  MSize d, valid = (tv && tvisnumber(tv)) ? (MSize)numberVnum(tv) : 0;
+  if (valid > n-1) valid = n-1;
+  for (d = 0; d < valid; d++) {
+    const int32_t *f = &fr[2*(n-1-d)];
+    cTValue *id = lj_tab_getint(cache, ADDRCACHE_SLOT(d, 0));
+    cTValue *pos = lj_tab_getint(cache, ADDRCACHE_SLOT(d, 1));
+    if (!(id && pos && tvisnumber(id) && tvisnumber(pos) &&
+	  numberVnum(id) == (lua_Number)f[0] &&
+	  numberVnum(pos) == (lua_Number)f[1]))
+      break;
+  }
+  return d;
+}
+
+/* Store a frame and its prefix into the frame cache. */
+static void debug_addrcacheset(lua_State *L, GCtab *cache, MSize d,
+			       const int32_t *f, cTValue *prefix)
+{
+  setnumV(lj_tab_setint(L, cache, ADDRCACHE_SLOT(d, 0)), (lua_Number)f[0]);
+  setnumV(lj_tab_setint(L, cache, ADDRCACHE_SLOT(d, 1)), (lua_Number)f[1]);
+  copyTV(L, lj_tab_setint(L, cache, ADDRCACHE_SLOT(d, 2)), prefix);
+}
+
+/* Get the structural address of the call site at a level.
+** Reads the loop counter of every frame's call site from the table lc and
+** increments the one for the innermost call site. The frame cache is
+** optional (NULL).
+*/
+GCstr *lj_debug_address(lua_State *L, int level, int32_t rootid, int hasroot,
+			GCtab *lc, GCtab *cache)
+{
+  SBuf *sb = &G(L)->tmpbuf;
+  MSize i, n = debug_addrframes(L, level, rootid, hasroot);
+  MSize sz = n*2*(MSize)sizeof(int32_t), hit = 0, plen = 0;
+  GCstr *prefix = NULL;
+  int32_t *fr;
+  char *name, *p;
+  if (n == 0)
+    return &G(L)->strempty;
+  if (cache) {
+    hit = debug_addrcachehit(cache, (const int32_t *)sb->buf, n);
+    if (hit) {
+      cTValue *tv = lj_tab_getint(cache, ADDRCACHE_SLOT(hit-1, 2));
+      if (tv && tvisstr(tv)) {
+	prefix = strV(tv);
+	plen = prefix->len;
+      } else {
+	hit = 0;
+      }
+    }
+  }
+  /* No GC steps below, so the temp buffer stays put. */
+  lj_str_needbuf(L, sb, sz + plen + (n-hit)*ADDR_MAXFMT);
+  fr = (int32_t *)sb->buf;
+  name = p = sb->buf + sz;
+  if (prefix) {
+    memcpy(p, strdata(prefix), plen);
+    p += plen;
+  }
+  for (i = n-hit; i-- > 0; ) {
+    GCstr *key;
+    cTValue *tv;
+    lua_Number loop = 0;
+    p = debug_addrint(p, fr[2*i]);
+    *p++ = ':';
+    p = debug_addrint(p, fr[2*i+1]);
+    key = lj_str_new(L, name, (size_t)(p-name));
+    tv = lj_tab_getstr(lc, key);
+    if (tv && tvisnumber(tv))
+      loop = numberVnum(tv);
+    if (i == 0) {  /* Innermost call site: bump its loop counter. */
+      setnumV(lj_tab_setstr(L, lc, key), loop+1);
+      lj_gc_anybarriert(L, lc);
+    }
+    *p++ = ':';
+    p = debug_addrint(p, (int32_t)loop);
+    *p++ = '|';
+    if (cache && i > 0) {
+      TValue tvp;
+      setstrV(L, &tvp, lj_str_new(L, name, (size_t)(p-name)));
+      debug_addrcacheset(L, cache, n-1-i, &fr[2*i], &tvp);
+    }
+  }
+  if (cache) {
+    setnumV(lj_tab_setint(L, cache, 1), (lua_Number)(n-1));
+    lj_gc_anybarriert(L, cache);
+  }
+  return lj_str_new(L, name, (size_t)(p-name));
+}
+
+/* Mixing step for hashed addresses: folds x into h with a boost-style
+** hash_combine (golden ratio constant plus shifted copies of h), then
+** scrambles the result with the MurmurHash3 64 bit finalizer (fmix64).
+*/
+static uint64_t debug_addrmix(uint64_t h, uint64_t x)
+{
+  h ^= x + U64x(9e3779b9,7f4a7c15) + (h << 6) + (h >> 2);
+  h ^= h >> 33;
+  h *= U64x(ff51afd7,ed558ccd);
+  h ^= h >> 33;
+  h *= U64x(c4ceb9fe,1a85ec53);
+  h ^= h >> 33;
+  return h;
+}
+
+/* Like lj_debug_address(), but returns a rolling hash of the address.
+** The hash state is truncated to 53 bits after every step, so it's exactly
+** representable as a number. The loop counters in lc are keyed by the
+** hashed prefixes, too.
+*/
+lua_Number lj_debug_addresshash(lua_State *L, int level, int32_t rootid,
+				int hasroot, GCtab *lc, GCtab *cache)
+{
+  MSize i, n = debug_addrframes(L, level, rootid, hasroot), hit = 0;
+  const int32_t *fr = (const int32_t *)G(L)->tmpbuf.buf;
+  uint64_t h = 0;
+  if (n == 0)
+    return 0;
+  if (cache) {
+    hit = debug_addrcachehit(cache, fr, n);
+    if (hit) {
+      cTValue *tv = lj_tab_getint(cache, ADDRCACHE_SLOT(hit-1, 2));
+      if (tv && tvisnumber(tv))
+	h = (uint64_t)numberVnum(tv);
+      else
+	hit = 0;
+    }
+  }
+  for (i = n-hit; i-- > 0; ) {
+    TValue key;
+    cTValue *tv;
+    lua_Number loop = 0;
+    h = debug_addrmix(h, ((uint64_t)(uint32_t)fr[2*i] << 32) |
+			 (uint64_t)(uint32_t)fr[2*i+1]) >> 11;
+    setnumV(&key, (lua_Number)(int64_t)h);
+    tv = lj_tab_get(L, lc, &key);
+    if (tvisnumber(tv))
+      loop = numberVnum(tv);
+    if (i == 0)  /* Innermost call site: bump its loop counter. */
+      setnumV(lj_tab_set(L, lc, &key), loop+1);
+    h = debug_addrmix(h, (uint64_t)loop) >> 11;
+    if (cache && i > 0) {
+      TValue tvp;
+      setnumV(&tvp, (lua_Number)(int64_t)h);
+      debug_addrcacheset(L, cache, n-1-i, &fr[2*i], &tvp);
+    }
+  }
+  if (cache)
+    setnumV(lj_tab_setint(L, cache, 1), (lua_Number)(n-1));
+  return (lua_Number)(int64_t)h;
+}
+
 /* Number of frames for the leading and trailing part of a traceback. */
 #define TRACEBACK_LEVELS1	12
 #define TRACEBACK_LEVELS2	10
@@ -44,6 +44,13 @@ LJ_FUNC void lj_debug_addloc(lua_State *L, const char *msg,
 LJ_FUNC void lj_debug_pushloc(lua_State *L, GCproto *pt, BCPos pc);
 LJ_FUNC int lj_debug_getinfo(lua_State *L, const char *what, lj_Debug *ar,
 			     int ext);
+LJ_FUNC cTValue *lj_debug_callsite(lua_State *L, int level, int32_t *id,
+				   int32_t *pos);
+LJ_FUNC GCstr *lj_debug_address(lua_State *L, int level, int32_t rootid,
+				int hasroot, GCtab *lc, GCtab *cache);
+LJ_FUNC lua_Number lj_debug_addresshash(lua_State *L, int level,
+					int32_t rootid, int hasroot, GCtab *lc,
+					GCtab *cache);
 
 /* Fixed internal variable names. */
 #define VARNAMEDEF(_) \
@@ -27,6 +27,8 @@
 #include "lj_dispatch.h"
 #include "lj_vm.h"
 #include "lj_strscan.h"
+#include "lj_debug.h"
+#include "lj_lib.h"
 
 /* Some local macros to save typing. Undef'd at the end. */
 #define IR(ref)			(&J->cur.ir[(ref)])
@@ -855,6 +857,66 @@ static void LJ_FASTCALL recff_io_flush(jit_State *J, RecordFFData *rd)
   J->base[0] = TREF_TRUE;
 }
 
+/* -- Debug library fast functions ---------------------------------------- */
+
+/* dritchie: the prototype and call site of a frame are fixed by the trace
+** for all frames entered on-trace (and for the start frame). The same walk
+** as in the interpreter runs at record time, and the results are emitted
+** as constants. Frames below the start frame abort recording.
+*/
+static void LJ_FASTCALL recff_debug_callsite(jit_State *J, RecordFFData *rd)
+{
+  TRef tr = J->base[0];
+  int32_t level = 1, id, pos;
+  cTValue *frame;
+  if (tr && !tref_isnil(tr)) {
+    if (!tref_isk(tr))
+      recff_nyiu(J);
+    level = argv2int(J, &rd->argv[0]);
+  }
+  if (level < 1)
+    recff_nyiu(J);  /* Interpreter will throw. */
+  frame = lj_debug_callsite(J->L, level, &id, &pos);
+  if (!frame || frame < J->L->base - J->baseslot)
+    recff_nyiu(J);
+  J->base[0] = lj_ir_kint(J, id);
+  J->base[1] = lj_ir_kint(J, pos);
+  rd->nres = 2;
+}
+
+/* -- ERP math library fast functions ------------------------------------- */
+
+/* dritchie: the special functions of the erpmath library are plain C calls
+** on numbers. One-argument ones are recorded like math.sinh.
+*/
+static void LJ_FASTCALL recff_erpmath_call2(jit_State *J, RecordFFData *rd)
+{
+  TRef a = lj_ir_tonum(J, J->base[0]);
+  TRef b = lj_ir_tonum(J, J->base[1]);
+  J->base[0] = lj_ir_call(J, rd->data, a, b);
+}
+
+/* Record the samplers that draw from a stream (erpmath.gaussian etc.).
+** Like calls to the stream itself, they are specialized to the stream, so
+** its state is a constant of the trace.
+*/
+static void LJ_FASTCALL recff_erpmath_draw(jit_State *J, RecordFFData *rd)
+{
+  RandomState *rs = lj_math_streamstate(&rd->argv[0]);
+  TRef trs, a;
+  if (!rs) {
+    recff_nyiu(J);
+    return;
+  }
+  emitir(IRTG(IR_EQ, IRT_FUNC), J->base[0], lj_ir_kfunc(J, funcV(&rd->argv[0])));
+  trs = lj_ir_kptr(J, rs);
+  a = lj_ir_tonum(J, J->base[1]);
+  if (rd->data == IRCALL_lj_erpmath_exponential)
+    J->base[0] = lj_ir_call(J, rd->data, trs, a);
+  else
+    J->base[0] = lj_ir_call(J, rd->data, trs, a, lj_ir_tonum(J, J->base[2]));
+}
+
 /* -- Record calls to fast functions -------------------------------------- */
 
 #include "lj_recdef.h"
@@ -117,6 +117,15 @@ typedef struct CCallInfo {
   _(ANY,	sinh,			ARG1_FP,  N, NUM, 0) \
   _(ANY,	cosh,			ARG1_FP,  N, NUM, 0) \
   _(ANY,	tanh,			ARG1_FP,  N, NUM, 0) \
+  _(ANY,	lj_erpmath_lgamma,	ARG1_FP,  N, NUM, 0) \
+  _(ANY,	lj_erpmath_digamma,	ARG1_FP,  N, NUM, 0) \
+  _(ANY,	lj_erpmath_lfact,	ARG1_FP,  N, NUM, 0) \
+  _(ANY,	lj_erpmath_lbeta,	ARG1_FP*2, N, NUM, 0) \
+  _(ANY,	lj_erpmath_lchoose,	ARG1_FP*2, N, NUM, 0) \
+  _(ANY,	lj_erpmath_gaussian,	1+ARG1_FP*2, S, NUM, 0) \
+  _(ANY,	lj_erpmath_exponential,	1+ARG1_FP, S, NUM, 0) \
+  _(ANY,	lj_erpmath_gamma,	1+ARG1_FP*2, S, NUM, 0) \
+  _(ANY,	lj_erpmath_beta,	1+ARG1_FP*2, S, NUM, 0) \
   _(ANY,	fputc,			2,  S, INT, 0) \
   _(ANY,	fwrite,			4,  S, INT, 0) \
   _(ANY,	fflush,			1,  S, INT, 0) \
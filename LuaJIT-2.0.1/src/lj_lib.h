@@ -108,5 +108,16 @@ LJ_FUNC void lj_lib_register(lua_State *L, const char *libname,
 
 typedef struct RandomState RandomState;
 LJ_FUNC uint64_t LJ_FASTCALL lj_math_random_step(RandomState *rs);
+LJ_FUNC RandomState *lj_math_streamstate(cTValue *o);
+LJ_FUNC RandomState *lj_math_checkstream(lua_State *L, int narg);
+LJ_FUNC double lj_erpmath_lgamma(double x);
+LJ_FUNC double lj_erpmath_digamma(double x);
+LJ_FUNC double lj_erpmath_lfact(double n);
+LJ_FUNC double lj_erpmath_lbeta(double a, double b);
+LJ_FUNC double lj_erpmath_lchoose(double n, double k);
+LJ_FUNC double lj_erpmath_gaussian(RandomState *rs, double mu, double sigma);
+LJ_FUNC double lj_erpmath_exponential(RandomState *rs, double rate);
+LJ_FUNC double lj_erpmath_gamma(RandomState *rs, double a, double b);
+LJ_FUNC double lj_erpmath_beta(RandomState *rs, double a, double b);
 
 #endif
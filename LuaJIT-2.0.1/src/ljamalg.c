@@ -89,5 +89,7 @@
 #include "lib_bit.c"
 #include "lib_jit.c"
 #include "lib_ffi.c"
+#include "lib_parallel.c"
+#include "lib_erpmath.c"
 #include "lib_init.c"
 
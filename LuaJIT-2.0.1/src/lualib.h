@@ -21,6 +21,8 @@
 #define LUA_BITLIBNAME	"bit"
 #define LUA_JITLIBNAME	"jit"
 #define LUA_FFILIBNAME	"ffi"
+#define LUA_PARALLELLIBNAME	"parallel"
+#define LUA_ERPMATHLIBNAME	"erpmath"
 
 LUALIB_API int luaopen_base(lua_State *L);
 LUALIB_API int luaopen_math(lua_State *L);
@@ -33,6 +35,8 @@ LUALIB_API int luaopen_debug(lua_State *L);
 LUALIB_API int luaopen_bit(lua_State *L);
 LUALIB_API int luaopen_jit(lua_State *L);
 LUALIB_API int luaopen_ffi(lua_State *L);
+LUALIB_API int luaopen_parallel(lua_State *L);
+LUALIB_API int luaopen_erpmath(lua_State *L);
 
 LUALIB_API void luaL_openlibs(lua_State *L);
 
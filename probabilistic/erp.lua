@@ -2,22 +2,29 @@ local dirOfThisFile = (...):match("(.-)[^%.]+$")
 
 local trace = require(dirOfThisFile .. "trace")
 local util = require(dirOfThisFile .. "util")
+local ffi = require("ffi")
 
 module(..., package.seeall)
 
+-- Special functions from the native erpmath library
+local lgamma, lbeta, lchoose, lfact = erpmath.lgamma, erpmath.lbeta, erpmath.lchoose, erpmath.lfact
+
 -- Code for computing log probabilities should be converted to Terra functions
 
 -- Abstract base class for all ERPs
+-- Samplers and proposals draw from the generator stream 'random' they
+-- are given (math.random or a stream from math.newrandom), never from
+-- math.random directly, so that each chain can have its own stream
 local RandomPrimitive = {}
 
 function RandomPrimitive:new()
-	local newobj = {}
+	local newobj = { scratchParams = {} }
 	setmetatable(newobj, self)
 	self.__index = self
 	return newobj
 end
 
-function RandomPrimitive:sample_impl(params)
+function RandomPrimitive:sample_impl(params, random)
 	error("ERP subclasses must implement sample_impl!")
 end
 
@@ -31,32 +38,212 @@ function RandomPrimitive:sample(params, isStructural, conditionedValue)
 	return trace.lookupVariableValue(self, params, isStructural, 0, conditionedValue)
 end
 
-function RandomPrimitive:proposal(currval, params)
+-- Like sample, for ERPs with at most two parameters, which are passed
+-- directly (and compared by identity, like the entries of a params table).
+-- No parameter table is made when the variable already exists with the
+-- same parameters, so such calls allocate nothing.
+function RandomPrimitive:sampleScalar(p1, p2, isStructural, conditionedValue)
+	-- NOTE: The 5th arg is 0 for the same reason as in 'sample'
+	return trace.lookupScalarVariableValue(self, p1, p2, isStructural, 0, conditionedValue)
+end
+
+-- sample_impl and logprob with the parameters passed directly, for
+-- sampleScalar. Registered ERPs replace these with direct calls to their
+-- plain functions (see register); this version serves any other ERP.
+function RandomPrimitive:sampleArgs(random, p1, p2)
+	-- The parameters only live as long as this call, so a scratch table will do
+	local params = self.scratchParams
+	params[1], params[2] = p1, p2
+	return self:sample_impl(params, random)
+end
+
+function RandomPrimitive:logprobArgs(val, p1, p2)
+	local params = self.scratchParams
+	params[1], params[2] = p1, p2
+	return self:logprob(val, params)
+end
+
+-- ERPs with a drift kernel (a local proposal around currval) give its step
+-- size in 'driftScale'; 'scale' is an extra per-variable multiplier that
+-- the kernels adapt during burn-in (nil means 1)
+function RandomPrimitive:proposal(currval, params, random, scale)
 	-- Subclasses can override to do more efficient proposals
-	return self:sample_impl(params)
+	return self:sample_impl(params, random)
 end
 
-function RandomPrimitive:logProposalProb(currval, propval, params)
+function RandomPrimitive:logProposalProb(currval, propval, params, scale)
 	-- Subclasses can override to do more efficient proposals
 	return self:logprob(propval, params)
 end
 
+-- ERPs with finite support return a list of the values they can take
+-- (which callers must not change), so that their variables can be
+-- updated by enumeration (see RandomWalkKernel:gibbsStep)
+function RandomPrimitive:support(params)
+	return nil
+end
+
+-- Summed log probability of the first 'n' values of 'vals', which is a Lua
+-- array or an FFI double array (indexed from 0); 'n' defaults to #vals
+function RandomPrimitive:logprobBatch(vals, params, n)
+	-- Subclasses can override with a kernel from the erpmath library
+	local base = (type(vals) == "table") and 1 or 0
+	n = n or table.getn(vals)
+	local lp = 0.0
+	for i=base,base+n-1 do
+		lp = lp + self:logprob(vals[i], params)
+	end
+	return lp
+end
+
+-- Draw 'n' samples into 'out' (a Lua array or an FFI double array),
+-- or into a new table if 'out' is nil, and return it
+function RandomPrimitive:sampleBatch(n, params, random, out)
+	-- Subclasses can override with a kernel from the erpmath library
+	out = out or {}
+	local base = (type(out) == "table") and 1 or 0
+	for i=base,base+n-1 do
+		out[i] = self:sample_impl(params, random)
+	end
+	return out
+end
+
+-------------------
+
+-- The registered ERP objects, by name; also useful for batched scoring and
+-- sampling (e.g. erp.primitives.gaussian:logprobBatch(data, {mu, sigma}))
+primitives = {}
+
+local lookupVariableValue = trace.lookupVariableValue
+local lookupScalarVariableValue = trace.lookupScalarVariableValue
+
+-- Register the single instance 'inst' of an ERP kind under 'name'.
+-- Every method the instance inherits is copied onto it, so that calls
+-- through it (e.g. erp:logprob in the traces) find their method with one
+-- lookup instead of walking the class chain; class fields such as
+-- driftScale are copied too, so change them on the registered instance.
+-- ERPs with at most two parameters also pass plain functions
+-- sample(random, p1, p2) and logprob(val, p1, p2), which the traces then
+-- call directly through sampleArgs and logprobArgs.
+-- Returns the instance and its front end, a closure that looks up a
+-- variable of this ERP: (p1, p2, isStructural, conditionedValue) when
+-- 'sample' is given, and (params, isStructural, conditionedValue) if not.
+local function register(name, inst, sample, logprob)
+	local class = getmetatable(inst)
+	while class do
+		for k,v in pairs(class) do
+			if k ~= "__index" and rawget(inst, k) == nil then
+				inst[k] = v
+			end
+		end
+		class = getmetatable(class)
+	end
+	primitives[name] = inst
+	-- NOTE: The front ends pass 0 frames to skip because they tail call
+	-- the lookup functions, as do the ERP functions that call them
+	if sample then
+		inst.sampleArgs = function(self, random, p1, p2) return sample(random, p1, p2) end
+		inst.logprobArgs = function(self, val, p1, p2) return logprob(val, p1, p2) end
+		return inst, function(p1, p2, isStructural, conditionedValue)
+			return lookupScalarVariableValue(inst, p1, p2, isStructural, 0, conditionedValue)
+		end
+	else
+		return inst, function(params, isStructural, conditionedValue)
+			return lookupVariableValue(inst, params, isStructural, 0, conditionedValue)
+		end
+	end
+end
+
+-------------------
+
+-- Values of vector-valued ERPs: 'n' doubles stored contiguously, indexed
+-- from 1 like Lua arrays (x[0] is unused), with #v giving 'n'.
+-- Like all ERP values they are shared between traces, so they must not be
+-- changed in place once an ERP has returned them.
+-- Vectors are FFI objects, not tables: only indexing, # and the array
+-- helpers in util (map, filter, sum, arrayequals) work on them. pairs,
+-- ipairs, unpack and table.getn do not; loop from 1 to #v, or convert
+-- with v:totable().
+ffi.cdef[[
+typedef struct { int n; double x[?]; } erp_vector;
+]]
+
+local Vector
+local vectorMethods = {}
+
+-- A new vector of length 'n' (zero-filled), or a copy of the Lua array 'n'
+function vector(n)
+	if type(n) == "table" then
+		local tbl = n
+		local v = Vector(table.getn(tbl)+1)
+		v.n = table.getn(tbl)
+		for i=1,v.n do v.x[i] = tbl[i] end
+		return v
+	end
+	local v = Vector(n+1)
+	v.n = n
+	return v
+end
+
+function isvector(v)
+	return ffi.istype(Vector, v)
+end
+
+function vectorMethods:copy()
+	local v = Vector(self.n+1)
+	v.n = self.n
+	ffi.copy(v.x, self.x, (self.n+1)*ffi.sizeof("double"))
+	return v
+end
+
+-- (e.g. to return a vector value from parallel chains, whose results are
+--  serialized)
+function vectorMethods:totable()
+	local tbl = {}
+	for i=1,self.n do tbl[i] = self.x[i] end
+	return tbl
+end
+
+Vector = ffi.metatype("erp_vector",
+{
+	__len = function(v) return v.n end,
+	__index = function(v, k)
+		if type(k) == "number" then
+			return v.x[k]
+		end
+		return vectorMethods[k]
+	end,
+	__newindex = function(v, k, val) v.x[k] = val end,
+	__tostring = function(v)
+		local strs = {}
+		for i=1,v.n do strs[i] = tostring(v.x[i]) end
+		return "vector(" .. table.concat(strs, ", ") .. ")"
+	end
+})
+
 -------------------
 
 local FlipRandomPrimitive = RandomPrimitive:new()
 
-function FlipRandomPrimitive:sample_impl(params)
-	local randval = math.random()
-	return (randval < params[1]) and 1 or 0
+local function flip_sample(random, p)
+	local randval = random()
+	return (randval < p) and 1 or 0
 end
 
-function FlipRandomPrimitive:logprob(val, params)
-	local p = params[1]
+local function flip_logprob(val, p)
 	local prob = (val ~= 0) and p or 1.0-p
 	return math.log(prob)
 end
 
-function FlipRandomPrimitive:proposal(currval, params)
+function FlipRandomPrimitive:sample_impl(params, random)
+	return flip_sample(random, params[1])
+end
+
+function FlipRandomPrimitive:logprob(val, params)
+	return flip_logprob(val, params[1])
+end
+
+function FlipRandomPrimitive:proposal(currval, params, random)
 	return (currval == 0) and 1 or 0
 end
 
@@ -64,39 +251,139 @@ function FlipRandomPrimitive:logProposalProb(currval, propval, params)
 	return 0.0
 end
 
-local flipInst = FlipRandomPrimitive:new()
+local flipSupport = {0, 1}
+function FlipRandomPrimitive:support(params)
+	return flipSupport
+end
+
+function FlipRandomPrimitive:logprobBatch(vals, params, n)
+	return erpmath.flip_logprob(vals, n, params[1])
+end
+
+function FlipRandomPrimitive:sampleBatch(n, params, random, out)
+	return erpmath.flip_sample(random, n, params[1], out)
+end
+
+local flipInst, flipLookup = register("flip", FlipRandomPrimitive:new(), flip_sample, flip_logprob)
 function flip(p, isStructural, conditionedValue)
 	p = (p == nil) and 0.5 or p
-	return flipInst:sample({p}, isStructural, conditionedValue)
+	return flipLookup(p, nil, isStructural, conditionedValue)
 end
 
 -------------------
 
 local MultinomialRandomPrimitive = RandomPrimitive:new()
 
-local function multinomial_sample(theta)
-	local result = 1
-	local x = math.random() * util.sum(theta)
-	local probAccum = 0.00000001
-	local k = table.getn(theta)
-	while result <= k and x > probAccum do
-		probAccum = probAccum + theta[result]
-		result = result + 1
+-- The normalizer and Walker alias table of each parameter vector, keyed by
+-- the vector itself, so each one is only built once. (Parameter vectors
+-- must not be changed in place once they have been used.)
+-- Building the tables costs several times as much as scanning the vector
+-- once, so they are only built for vectors of at least aliasMinCategories
+-- entries, and only once such a vector is drawn from a second time (until
+-- then, it maps to false). Smaller vectors are always scanned.
+local multinomialTables = setmetatable({}, {__mode = "k"})
+local aliasMinCategories = 16
+
+local function build_multinomial_tables(theta)
+	local k = #theta
+	local total = 0
+	for i=1,k do total = total + theta[i] end
+	local prob = {}
+	local alias = {}
+	-- Vose's method: split the scaled probabilities into those below and
+	-- above 1, and top each small one up with part of a large one
+	local small, large = {}, {}
+	for i=1,k do
+		prob[i] = theta[i] * k / total
+		if prob[i] < 1 then
+			table.insert(small, i)
+		else
+			table.insert(large, i)
+		end
+	end
+	while table.getn(small) > 0 and table.getn(large) > 0 do
+		local s = table.remove(small)
+		local l = large[table.getn(large)]
+		alias[s] = l
+		prob[l] = prob[l] + prob[s] - 1
+		if prob[l] < 1 then
+			table.remove(large)
+			table.insert(small, l)
+		end
+	end
+	-- Whatever is left over is 1 up to rounding error
+	for i,l in ipairs(large) do prob[l] = 1 end
+	for i,s in ipairs(small) do prob[s] = 1 end
+	return {k = k, total = total, prob = prob, alias = alias}
+end
+
+-- The alias tables of 'theta', or nil if it should be scanned instead
+local function multinomial_tables(theta)
+	local tbls = multinomialTables[theta]
+	if tbls then
+		return tbls
+	elseif tbls == false then
+		tbls = build_multinomial_tables(theta)
+		multinomialTables[theta] = tbls
+		return tbls
+	elseif #theta >= aliasMinCategories then
+		multinomialTables[theta] = false
+	end
+	return nil
+end
+
+local function multinomial_total(theta)
+	local tbls = multinomialTables[theta]
+	if tbls then
+		return tbls.total
+	end
+	local total = 0
+	for i=1,#theta do total = total + theta[i] end
+	return total
+end
+
+-- Draw from theta, leaving out index 'skip' (if given), whose weights
+-- (other than theta[skip]) sum to 'total'
+local function multinomial_scan(random, theta, total, skip)
+	local x = random() * total
+	local val = nil
+	for i=1,#theta do
+		if i ~= skip and theta[i] > 0 then
+			val = i
+			x = x - theta[i]
+			if x < 0 then break end
+		end
+	end
+	return val
+end
+
+local function multinomial_sample(random, theta)
+	local tbls = multinomial_tables(theta)
+	if not tbls then
+		return multinomial_scan(random, theta, multinomial_total(theta))
+	end
+	local u = random() * tbls.k
+	local i = math.floor(u)
+	u = u - i
+	i = i + 1
+	if u < tbls.prob[i] then
+		return i
+	else
+		return tbls.alias[i]
 	end
-	return result - 1
 end
 
 function multinomial_logprob(n, theta)
-	if n < 1 or n > table.getn(theta) then
+	if n < 1 or n > #theta then
 		return -math.huge
 	else
 		n = math.ceil(n)
-		return math.log(theta[n]/util.sum(theta))
+		return math.log(theta[n]/multinomial_total(theta))
 	end
 end
 
-function MultinomialRandomPrimitive:sample_impl(params)
-	return multinomial_sample(params)
+function MultinomialRandomPrimitive:sample_impl(params, random)
+	return multinomial_sample(random, params)
 end
 
 function MultinomialRandomPrimitive:logprob(val, params)
@@ -104,198 +391,293 @@ function MultinomialRandomPrimitive:logprob(val, params)
 end
 
 -- Multinomial with currval projected out
-function MultinomialRandomPrimitive:proposal(currval, params)
-	local newparams = util.copytable(params)
-	newparams[currval] = 0
-	return multinomial_sample(newparams)
+-- (With alias tables, redraws until it gets another value, which takes
+--  fewer than two draws on average unless currval has most of the mass;
+--  otherwise it scans the vector)
+function MultinomialRandomPrimitive:proposal(currval, params, random)
+	local total = multinomial_total(params)
+	local rest = total - params[currval]
+	if rest <= 0 then
+		return currval
+	end
+	local tbls = (rest >= 0.5*total) and multinomial_tables(params)
+	if tbls then
+		local val = currval
+		repeat
+			val = multinomial_sample(random, params)
+		until val ~= currval
+		return val
+	else
+		return multinomial_scan(random, params, rest, currval)
+	end
 end
 
 -- Multinomial with currval projected out
 function MultinomialRandomPrimitive:logProposalProb(currval, propval, params)
-	local newparams = util.copytable(params)
-	newparams[currval] = 0
-	return multinomial_logprob(propval, newparams)
+	if propval == currval or propval < 1 or propval > #params then
+		return -math.huge
+	end
+	return math.log(params[math.ceil(propval)]/(multinomial_total(params) - params[currval]))
+end
+
+-- (Leaves out the values with zero weight)
+function MultinomialRandomPrimitive:support(params)
+	local vals = {}
+	for i=1,#params do
+		if params[i] > 0 then
+			table.insert(vals, i)
+		end
+	end
+	return vals
 end
 
-local multinomialInst = MultinomialRandomPrimitive:new()
+local multinomialInst, multinomialLookup = register("multinomial", MultinomialRandomPrimitive:new())
 function multinomial(theta, isStructural, conditionedValue)
-	return multinomialInst:sample(theta, isStructural, conditionedValue)
+	return multinomialLookup(theta, isStructural, conditionedValue)
 end
 
 function multinomialDraw(items, probs, isStructural)
 	return items[multinomial(probs, isStructural)]
 end
 
+-- Uniform parameter vectors, by length (reused so that their alias
+-- tables are too)
+local uniformProbs = {}
+
 function uniformDraw(items, isStructural)
 	local n = table.getn(items)
-	local invn = 1/n
-	local probs = {}
-	for i=1,n do
-		table.insert(probs, invn)
+	local probs = uniformProbs[n]
+	if not probs then
+		local invn = 1/n
+		probs = {}
+		for i=1,n do
+			table.insert(probs, invn)
+		end
+		uniformProbs[n] = probs
 	end
 	return items[multinomial(probs, isStructural)]
 end
 
 -------------------
 
-local UniformRandomPrimitive = RandomPrimitive:new()
+local GaussianRandomPrimitive = RandomPrimitive:new()
+
+-- (Ziggurat sampler from the native erpmath library)
+local gaussian_sample = erpmath.gaussian
 
-function UniformRandomPrimitive:sample_impl(params)
-	local u = math.random()
-	return (1-u)*params[1] + u*params[2]
+function gaussian_logprob(x, mu, sigma)
+	return -.5*(1.8378770664093453 + 2*math.log(sigma) + (x - mu)*(x - mu)/(sigma*sigma))
 end
 
-function UniformRandomPrimitive:logprob(val, params)
-	if val < params[1] or val > params[2] then return -math.huge end
-	return -math.log(params[2] - params[1])
+function GaussianRandomPrimitive:sample_impl(params, random)
+	return gaussian_sample(random, params[1], params[2])
 end
 
-local uniformInst = UniformRandomPrimitive:new()
-function uniform(lo, hi, isStructural, conditionedValue)
-	return uniformInst:sample({lo, hi}, isStructural, conditionedValue)
+function GaussianRandomPrimitive:logprob(val, params)
+	return gaussian_logprob(val, params[1], params[2])
 end
 
--------------------
+-- Drift kernel, with steps of standard deviation driftScale*sigma
+GaussianRandomPrimitive.driftScale = 1
 
-local GaussianRandomPrimitive = RandomPrimitive:new()
+function GaussianRandomPrimitive:proposal(currval, params, random, scale)
+	return gaussian_sample(random, currval, params[2]*self.driftScale*(scale or 1))
+end
 
-local function gaussian_sample(mu, sigma)
-	local u, v, x, y, q
-	repeat
-		u = 1 - math.random()
-		v = 1.7156 * (math.random() - 0.5)
-		x = u - 0.449871
-		y = math.abs(v) + 0.386595
-		q = x*x + y*(0.196*y - 0.25472*x)
-	until not(q >= 0.27597 and (q > 0.27846 or v*v > -4 * u * u * math.log(u)))
-	return mu + sigma*v/u
+-- Drift kernel
+function GaussianRandomPrimitive:logProposalProb(currval, propval, params, scale)
+	return gaussian_logprob(propval, currval, params[2]*self.driftScale*(scale or 1))
 end
 
-function gaussian_logprob(x, mu, sigma)
-	return -.5*(1.8378770664093453 + 2*math.log(sigma) + (x - mu)*(x - mu)/(sigma*sigma))
+function GaussianRandomPrimitive:logprobBatch(vals, params, n)
+	return erpmath.gaussian_logprob(vals, n, params[1], params[2])
 end
 
-function GaussianRandomPrimitive:sample_impl(params)
-	return gaussian_sample(unpack(params))
+function GaussianRandomPrimitive:sampleBatch(n, params, random, out)
+	return erpmath.gaussian_sample(random, n, params[1], params[2], out)
 end
 
-function GaussianRandomPrimitive:logprob(val, params)
-	return gaussian_logprob(val, unpack(params))
+local gaussianInst, gaussianLookup = register("gaussian", GaussianRandomPrimitive:new(), gaussian_sample, gaussian_logprob)
+function gaussian(mu, sigma, isStructural, conditionedValue)
+	return gaussianLookup(mu, sigma, isStructural, conditionedValue)
 end
 
--- Drift kernel
-function GaussianRandomPrimitive:propval(currval, params)
-	return gaussian_sample(currval, params[2])
+--------------------
+
+local UniformRandomPrimitive = RandomPrimitive:new()
+
+local function uniform_sample(random, lo, hi)
+	local u = random()
+	return (1-u)*lo + u*hi
+end
+
+local function uniform_logprob(val, lo, hi)
+	if val < lo or val > hi then return -math.huge end
+	return -math.log(hi - lo)
+end
+
+function UniformRandomPrimitive:sample_impl(params, random)
+	return uniform_sample(random, params[1], params[2])
+end
+
+function UniformRandomPrimitive:logprob(val, params)
+	return uniform_logprob(val, params[1], params[2])
+end
+
+-- Drift kernel: a Gaussian step reflected back into [lo, hi], whose
+-- standard deviation is driftScale times the width of the interval
+-- (Reflecting off both ends repeats with period 2*(hi-lo), so the step is
+--  folded back in one go, however large it is)
+UniformRandomPrimitive.driftScale = 0.25
+
+function UniformRandomPrimitive:proposal(currval, params, random, scale)
+	local lo, hi = params[1], params[2]
+	local w = hi - lo
+	local x = gaussian_sample(random, currval, w*self.driftScale*(scale or 1))
+	local t = (x - lo) % (2*w)
+	if t > w then
+		t = 2*w - t
+	end
+	return lo + t
 end
 
 -- Drift kernel
-function GaussianRandomPrimitive:logProposalProb(currval, propval, params)
-	return gaussian_logprob(propval, currval, params[2])
+-- (The reflected step is symmetric, so only the ratio matters, and the
+--  forward and reverse probabilities cancel)
+function UniformRandomPrimitive:logProposalProb(currval, propval, params, scale)
+	return 0.0
 end
 
-local gaussianInst = GaussianRandomPrimitive:new()
-function gaussian(mu, sigma, isStructural, conditionedValue)
-	return gaussianInst:sample({mu, sigma}, isStructural, conditionedValue)
+function UniformRandomPrimitive:logprobBatch(vals, params, n)
+	return erpmath.uniform_logprob(vals, n, params[1], params[2])
+end
+
+function UniformRandomPrimitive:sampleBatch(n, params, random, out)
+	return erpmath.uniform_sample(random, n, params[1], params[2], out)
+end
+
+local uniformInst, uniformLookup = register("uniform", UniformRandomPrimitive:new(), uniform_sample, uniform_logprob)
+function uniform(lo, hi, isStructural, conditionedValue)
+	return uniformLookup(lo, hi, isStructural, conditionedValue)
 end
 
 --------------------
 
 local GammaRandomPrimitive = RandomPrimitive:new()
 
-local function gamma_sample(a, b)
-	if a < 1 then return gamma_sample(1+a,b) * math.pow(math.random(), 1/a) end
-	local x, v, u
-	local d = a - 1/3
-	local c = 1/math.sqrt(9*d)
-	while true do
-		repeat
-			x = gaussian_sample(0, 1)
-			v = 1+c*x
-		until v > 0
-		v = v*v*v
-		u = math.random()
-		if (u < 1 - .331*x*x*x*x) or (math.log(u) < .5*x*x + d*(1 - v + math.log(v))) then
-			return b*d*v
-		end
-	end
+-- (Marsaglia-Tsang sampler from the native erpmath library)
+local gamma_sample = erpmath.gamma
+
+function gamma_logprob(x, a, b)
+	return (a - 1)*math.log(x) - x/b - lgamma(a) - a*math.log(b)
 end
 
-local gamma_cof = {76.18009172947146, -86.50532032941677, 24.01409824083091, -1.231739572450155, 0.1208650973866179e-2, -0.5395239384953e-5}
-local function log_gamma(xx)
-	local x = xx - 1
-	local tmp = x + 5.5
-	tmp = tmp - (x + 0.5)*math.log(tmp)
-	local ser = 1.000000000190015
-	for j=1,5 do
-		x = x + 1
-		ser = ser + gamma_cof[j] / x
-	end
-	return -tmp + math.log(2.5066282746310005*ser)
+function GammaRandomPrimitive:sample_impl(params, random)
+	return gamma_sample(random, params[1], params[2])
 end
 
-function gamma_logprob(x, a, b)
-	return (a - 1)*math.log(x) - x/b - log_gamma(a) - a*math.log(b)
+function GammaRandomPrimitive:logprob(val, params)
+	return gamma_logprob(val, params[1], params[2])
 end
 
-function GammaRandomPrimitive:sample_impl(params)
-	return gamma_sample(unpack(params))
+-- Drift kernel: a Gaussian random walk on log(x), with steps of standard
+-- deviation driftScale
+GammaRandomPrimitive.driftScale = 0.5
+
+function GammaRandomPrimitive:proposal(currval, params, random, scale)
+	return currval * math.exp(gaussian_sample(random, 0, self.driftScale*(scale or 1)))
 end
 
-function GammaRandomPrimitive:logprob(val, params)
-	return gamma_logprob(val, unpack(params))
+-- Drift kernel
+-- (The density of the step in log(x), times the Jacobian 1/propval)
+function GammaRandomPrimitive:logProposalProb(currval, propval, params, scale)
+	local lp = math.log(propval)
+	return gaussian_logprob(lp, math.log(currval), self.driftScale*(scale or 1)) - lp
 end
 
-local gammaInst = GammaRandomPrimitive:new()
+function GammaRandomPrimitive:logprobBatch(vals, params, n)
+	return erpmath.gamma_logprob(vals, n, params[1], params[2])
+end
+
+function GammaRandomPrimitive:sampleBatch(n, params, random, out)
+	return erpmath.gamma_sample(random, n, params[1], params[2], out)
+end
+
+local gammaInst, gammaLookup = register("gamma", GammaRandomPrimitive:new(), gamma_sample, gamma_logprob)
 function gamma(a, b, isStructural, conditionedValue)
-	return gammaInst:sample({a, b}, isStructural, conditionedValue)
+	return gammaLookup(a, b, isStructural, conditionedValue)
 end
 
 -----------------------
 
 local BetaRandomPrimitive = RandomPrimitive:new()
 
-local function beta_sample(a, b)
-	local x = gamma_sample(a, 1)
-	return x / (x + gamma_sample(b, 1))	
-end
-
-local function log_beta(a, b)
-	return log_gamma(a) + log_gamma(b) - log_gamma(a+b)
-end
+local beta_sample = erpmath.beta
 
 function beta_logprob(x, a, b)
 	if x > 0 and x < 1 then
-		return (a-1)*math.log(x) + (b-1)*math.log(1-x) - log_beta(a,b)
+		return (a-1)*math.log(x) + (b-1)*math.log(1-x) - lbeta(a,b)
 	else
 		return -math.huge
 	end
 end
 
-function BetaRandomPrimitive:sample_impl(params)
-	return beta_sample(unpack(params))
+function BetaRandomPrimitive:sample_impl(params, random)
+	return beta_sample(random, params[1], params[2])
 end
 
 function BetaRandomPrimitive:logprob(val, params)
-	return beta_logprob(val, unpack(params))
+	return beta_logprob(val, params[1], params[2])
 end
 
-local betaInst = BetaRandomPrimitive:new()
+-- Drift kernel: a Gaussian random walk on logit(x), with steps of
+-- standard deviation driftScale
+BetaRandomPrimitive.driftScale = 0.5
+
+function BetaRandomPrimitive:proposal(currval, params, random, scale)
+	local y = math.log(currval/(1-currval)) + gaussian_sample(random, 0, self.driftScale*(scale or 1))
+	-- (exp of a large positive number would overflow)
+	if y >= 0 then
+		return 1/(1 + math.exp(-y))
+	else
+		local e = math.exp(y)
+		return e/(1 + e)
+	end
+end
+
+-- Drift kernel
+-- (The density of the step in logit(x), times the Jacobian
+--  1/(propval*(1-propval)))
+function BetaRandomPrimitive:logProposalProb(currval, propval, params, scale)
+	local lp, lq = math.log(propval), math.log(1-propval)
+	return gaussian_logprob(lp - lq, math.log(currval/(1-currval)), self.driftScale*(scale or 1)) - lp - lq
+end
+
+function BetaRandomPrimitive:logprobBatch(vals, params, n)
+	return erpmath.beta_logprob(vals, n, params[1], params[2])
+end
+
+function BetaRandomPrimitive:sampleBatch(n, params, random, out)
+	return erpmath.beta_sample(random, n, params[1], params[2], out)
+end
+
+local betaInst, betaLookup = register("beta", BetaRandomPrimitive:new(), beta_sample, beta_logprob)
 function beta(a, b, isStructural, conditionedValue)
-	return betaInst:sample({a, b}, isStructural, conditionedValue)
+	return betaLookup(a, b, isStructural, conditionedValue)
 end
 
 ------------------------
 
 local BinomialRandomPrimitive = RandomPrimitive:new()
 
-local function binomial_sample(p, n)
+local function binomial_sample(random, p, n)
 	local k = 0
 	local N = 10
 	local a, b
 	while n > N do
 		a = 1 + math.floor(n/2)
 		b = 1 + n-a
-		x = beta_sample(a, b)
+		x = beta_sample(random, a, b)
 		if x >= p then
 			n = a - 1
 			p = p / x
@@ -307,62 +689,62 @@ local function binomial_sample(p, n)
 	end
 	local u = 0
 	for i=1,n do
-		u = math.random()
+		u = random()
 		if u < p then k = k + 1 end
 	end
 	return k
 end
 
-local function g(x)
-	if x == 0 then return 1 end
-	if x == 1 then return 0 end
-	local d = 1 - x
-	return (1 - (x * x) + (2 * x * math.log(x))) / (d * d)
+function binomial_logprob(s, p, n)
+	if s < 0 or s > n then return -math.huge end
+	-- (A term whose count is 0 is left out, so that p = 0 or 1 does not give
+	--  0*log(0); with a positive count, log(0) makes the result -inf)
+	local lp = lchoose(n, s)
+	if s > 0 then lp = lp + s*math.log(p) end
+	if s < n then lp = lp + (n-s)*math.log(1-p) end
+	return lp
 end
 
-function binomial_logprob(s, p, n)
-	local inv2 = 1/2
-	local inv3 = 1/3
-	local inv6 = 1/6
-	if s >= n then return -math.huge end
-	local q = 1-p
-	local S = s + inv2
-	local T = n - s - inv2
-	local d1 = s + inv6 - (n + inv3) * p
-	local d2 = q/(s+inv2) - p/(T+inv2) + (q-inv2)/(n+1)
-	local d2 = d1 + 0.02*d2
-	local num = 1 + q * g(S/(n*p)) + p * g(T/(n*q))
-	local den = (n + inv6) * p * q
-	local z = num / den
-	local invsd = math.sqrt(z)
-	z = d2 * invsd
-	return gaussian_logprob(z, 0, 1) + math.log(invsd)
-end
-
-function BinomialRandomPrimitive:sample_impl(params)
-	return binomial_sample(unpack(params))
+function BinomialRandomPrimitive:sample_impl(params, random)
+	return binomial_sample(random, params[1], params[2])
 end
 
 function BinomialRandomPrimitive:logprob(val, params)
-	return binomial_logprob(val, unpack(params))
+	return binomial_logprob(val, params[1], params[2])
+end
+
+function BinomialRandomPrimitive:support(params)
+	local vals = {}
+	for s=0,params[2] do
+		vals[s+1] = s
+	end
+	return vals
+end
+
+function BinomialRandomPrimitive:logprobBatch(vals, params, n)
+	return erpmath.binomial_logprob(vals, n, params[1], params[2])
 end
 
-local binomialInst = BinomialRandomPrimitive:new()
+function BinomialRandomPrimitive:sampleBatch(n, params, random, out)
+	return erpmath.binomial_sample(random, n, params[1], params[2], out)
+end
+
+local binomialInst, binomialLookup = register("binomial", BinomialRandomPrimitive:new(), binomial_sample, binomial_logprob)
 function binomial(p, n, isStructural, conditionedValue)
-	return binomialInst:sample({p, n}, isStructural, conditionedValue)
+	return binomialLookup(p, n, isStructural, conditionedValue)
 end
 
 ----------------------
 
 local PoissonRandomPrimitive = RandomPrimitive:new()
 
-local function poisson_sample(mu)
+local function poisson_sample(random, mu)
 	local k = 0
 	while mu > 10 do
 		local m = 7/8*mu
-		local x = gamma_sample(m, 1)
+		local x = gamma_sample(random, m, 1)
 		if x > mu then
-			return k + binomial_sample(mu/x, m-1)
+			return k + binomial_sample(random, mu/x, m-1)
 		else
 			mu = mu - x
 			k = k + 1
@@ -371,91 +753,258 @@ local function poisson_sample(mu)
 	local emu = math.exp(-mu)
 	local p = 1
 	while p > emu do
-		p = p * math.random()
+		p = p * random()
 		k = k + 1
 	end
 	return k-1
 end
 
-local function fact(x)
-	local t = 1
-	while x > 1 do
-		t = t * x
-		x = x - 1
-	end
-	return t
+function poisson_logprob(k, mu)
+	return k * math.log(mu) - mu - lfact(k)
 end
 
-local function lnfact(x)
-	if x < 1 then x = 1 end
-	if x < 12 then return math.log(fact(math.floor(x))) end
-	local invx = 1 / x
-	local invx2 = invx*invx
-	local invx3 = invx2*invx
-	local invx5 = invx3*invx2
-	local invx7 = invx5*invx2
-	local ssum = ((x + 0.5) * math.log(x)) - x
-	ssum = ssum + math.log(2*math.pi) / 2.0
-	ssum = ssum + (invx / 12) - (invx / 360)
-	ssum = ssum + (invx5 / 1260) - (invx7 / 1680)
-	return ssum
+function PoissonRandomPrimitive:sample_impl(params, random)
+	return poisson_sample(random, params[1])
 end
 
-function poisson_logprob(k, mu)
-	return k * math.log(mu) - mu - lnfact(k)
+function PoissonRandomPrimitive:logprob(val, params)
+	return poisson_logprob(val, params[1])
 end
 
-function PoissonRandomPrimitive:sample_impl(params)
-	return poisson_sample(params[1])
+function PoissonRandomPrimitive:logprobBatch(vals, params, n)
+	return erpmath.poisson_logprob(vals, n, params[1])
 end
 
-function PoissonRandomPrimitive:logprob(val, params)
-	return poisson_logprob(val, params[1])
+function PoissonRandomPrimitive:sampleBatch(n, params, random, out)
+	return erpmath.poisson_sample(random, n, params[1], out)
 end
 
-local poissonInst = PoissonRandomPrimitive:new()
+local poissonInst, poissonLookup = register("poisson", PoissonRandomPrimitive:new(), poisson_sample, poisson_logprob)
 function poisson(mu, isStructural, conditionedValue)
-	return poissonInst:sample({mu}, isStructural, conditionedValue)
+	return poissonLookup(mu, nil, isStructural, conditionedValue)
 end
 
 ---------------------
 
 local DirichletRandomPrimitive = RandomPrimitive:new()
 
-local function dirichlet_sample(alpha)
+-- Step size of the drift kernel, summed over all components
+DirichletRandomPrimitive.driftScale = 1
+
+-- The normalizer log(Gamma(sum(alpha))) - sum(log(Gamma(alpha_i))) of each
+-- parameter vector, keyed by the vector itself, so each one is only
+-- computed once. (Parameter vectors must not be changed in place once they
+-- have been used.)
+local dirichletNormalizers = setmetatable({}, {__mode = "k"})
+
+local function dirichlet_normalizer(alpha)
+	local lognorm = dirichletNormalizers[alpha]
+	if lognorm then
+		return lognorm
+	end
+	local asum = 0
+	lognorm = 0
+	for i=1,#alpha do
+		asum = asum + alpha[i]
+		lognorm = lognorm - lgamma(alpha[i])
+	end
+	lognorm = lognorm + lgamma(asum)
+	dirichletNormalizers[alpha] = lognorm
+	return lognorm
+end
+
+local function dirichlet_sample(random, alpha)
+	local k = #alpha
+	local theta = vector(k)
+	local x = theta.x
 	local ssum = 0
-	local theta = {}
-	for i,a in ipairs(alpha) do
-		local t = gamma_sample(a, 1)
-		table.insert(theta, t)
+	for i=1,k do
+		local t = gamma_sample(random, alpha[i], 1)
+		x[i] = t
 		ssum = ssum + t
 	end
-	for i,t in ipairs(theta) do
-		theta[i] = theta[i] / ssum
+	for i=1,k do
+		x[i] = x[i] / ssum
 	end
 	return theta
 end
 
 function dirichlet_logprob(theta, alpha)
-	local logp = log_gamma(util.sum(alpha))
-	for i=1,table.getn(alpha) do
+	local logp = dirichlet_normalizer(alpha)
+	for i=1,#alpha do
 		logp = logp + (alpha[i] - 1)*math.log(theta[i])
-		logp = logp - log_gamma(alpha[i])
 	end
 	return logp
 end
 
-function DirichletRandomPrimitive:sample_impl(params)
-	return dirichlet_sample(params)
+function DirichletRandomPrimitive:sample_impl(params, random)
+	return dirichlet_sample(random, params)
 end
 
 function DirichletRandomPrimitive:logprob(val, params)
 	return dirichlet_logprob(val, params)
 end
 
-local dirichletInst = DirichletRandomPrimitive:new()
+-- Drift kernel: a Gaussian random walk on the log-ratios log(theta_i/theta_k)
+-- (i < k), which scales each of the first k-1 components by a log-normal
+-- factor and renormalizes
+function DirichletRandomPrimitive:proposal(currval, params, random, scale)
+	local k = #currval
+	local sigma = self.driftScale*(scale or 1) / math.sqrt(math.max(k-1, 1))
+	local propval = vector(k)
+	local x = propval.x
+	local ssum = currval[k]
+	x[k] = ssum
+	for i=1,k-1 do
+		local t = currval[i] * math.exp(sigma*gaussian_sample(random, 0, 1))
+		x[i] = t
+		ssum = ssum + t
+	end
+	for i=1,k do
+		x[i] = x[i] / ssum
+	end
+	return propval
+end
+
+-- Drift kernel
+-- (The density of the log-ratio step, times the Jacobian 1/prod(propval_i)
+--  of the map from log-ratios back to the simplex)
+function DirichletRandomPrimitive:logProposalProb(currval, propval, params, scale)
+	local k = #currval
+	local sigma = self.driftScale*(scale or 1) / math.sqrt(math.max(k-1, 1))
+	local lck = math.log(currval[k])
+	local lpk = math.log(propval[k])
+	local ss = 0
+	local lp = -lpk
+	for i=1,k-1 do
+		local lpi = math.log(propval[i])
+		local d = (lpi - lpk) - (math.log(currval[i]) - lck)
+		ss = ss + d*d
+		lp = lp - lpi
+	end
+	return lp - .5*((k-1)*(1.8378770664093453 + 2*math.log(sigma)) + ss/(sigma*sigma))
+end
+
+local dirichletInst, dirichletLookup = register("dirichlet", DirichletRandomPrimitive:new())
+-- Returns a vector (see above), not a Lua array
 function dirichlet(alpha, isStructural, conditionedValue)
-	return dirichletInst:sample(alpha, isStructural, conditionedValue)
+	return dirichletLookup(alpha, isStructural, conditionedValue)
+end
+
+---------------------
+
+local MultivariateGaussianRandomPrimitive = RandomPrimitive:new()
+
+-- Step size of the drift kernel, summed over all components
+MultivariateGaussianRandomPrimitive.driftScale = 1
+
+-- The Cholesky factor L (row-major: L[(i-1)*k + j], j <= i) and log
+-- determinant of each covariance matrix (a Lua array of rows), keyed by the
+-- matrix itself, so each one is only factored once. (Covariance matrices
+-- must not be changed in place once they have been used.)
+local covarianceFactors = setmetatable({}, {__mode = "k"})
+
+local function covariance_factor(cov)
+	local fac = covarianceFactors[cov]
+	if fac then
+		return fac
+	end
+	local k = #cov
+	local Lvec = vector(k*k)
+	local L = Lvec.x
+	local logdet = 0
+	for i=1,k do
+		for j=1,i do
+			local s = cov[i][j]
+			for m=1,j-1 do
+				s = s - L[(i-1)*k+m]*L[(j-1)*k+m]
+			end
+			if i == j then
+				if s <= 0 then
+					error("multivariateGaussian: covariance matrix is not positive definite")
+				end
+				s = math.sqrt(s)
+				logdet = logdet + 2*math.log(s)
+			else
+				s = s / L[(j-1)*k+j]
+			end
+			L[(i-1)*k+j] = s
+		end
+	end
+	-- 'scratch' holds intermediate results of sampling and scoring
+	fac = {k = k, L = Lvec, logdet = logdet, scratch = vector(k)}
+	covarianceFactors[cov] = fac
+	return fac
+end
+
+-- (x - mu)' * inverse(cov) * (x - mu), by forward substitution with L
+local function mahalanobis_sq(fac, x, mu)
+	local k, L, y = fac.k, fac.L.x, fac.scratch.x
+	local ss = 0
+	for i=1,k do
+		local s = x[i] - mu[i]
+		for j=1,i-1 do
+			s = s - L[(i-1)*k+j]*y[j]
+		end
+		s = s / L[(i-1)*k+i]
+		y[i] = s
+		ss = ss + s*s
+	end
+	return ss
 end
 
+-- mu + scale*L*z, for z a vector of standard normals
+local function multivariate_gaussian_sample(random, mu, fac, scale)
+	local k, L, z = fac.k, fac.L.x, fac.scratch.x
+	for i=1,k do
+		z[i] = gaussian_sample(random, 0, 1)
+	end
+	local val = vector(k)
+	local x = val.x
+	for i=1,k do
+		local s = 0
+		for j=1,i do
+			s = s + L[(i-1)*k+j]*z[j]
+		end
+		x[i] = mu[i] + scale*s
+	end
+	return val
+end
+
+function multivariate_gaussian_logprob(x, mu, cov)
+	local fac = covariance_factor(cov)
+	return -.5*(fac.k*1.8378770664093453 + fac.logdet + mahalanobis_sq(fac, x, mu))
+end
+
+function MultivariateGaussianRandomPrimitive:sample_impl(params, random)
+	return multivariate_gaussian_sample(random, params[1], covariance_factor(params[2]), 1)
+end
 
+function MultivariateGaussianRandomPrimitive:logprob(val, params)
+	return multivariate_gaussian_logprob(val, params[1], params[2])
+end
+
+-- Drift kernel, with steps shaped like the prior covariance
+function MultivariateGaussianRandomPrimitive:proposal(currval, params, random, scale)
+	local fac = covariance_factor(params[2])
+	return multivariate_gaussian_sample(random, currval, fac, self.driftScale*(scale or 1) / math.sqrt(fac.k))
+end
+
+-- Drift kernel
+function MultivariateGaussianRandomPrimitive:logProposalProb(currval, propval, params, scale)
+	local fac = covariance_factor(params[2])
+	local k = fac.k
+	local step = self.driftScale*(scale or 1) / math.sqrt(k)
+	return -.5*(k*(1.8378770664093453 + 2*math.log(step)) + fac.logdet +
+				mahalanobis_sq(fac, propval, currval)/(step*step))
+end
+
+local multivariateGaussianInst, multivariateGaussianLookup =
+	register("multivariateGaussian", MultivariateGaussianRandomPrimitive:new(),
+			 function(random, mu, cov) return multivariate_gaussian_sample(random, mu, covariance_factor(cov), 1) end,
+			 multivariate_gaussian_logprob)
+-- 'mu' is a Lua array or vector, and 'cov' a Lua array of rows
+-- Returns a vector (see above), not a Lua array
+function multivariateGaussian(mu, cov, isStructural, conditionedValue)
+	return multivariateGaussianLookup(mu, cov, isStructural, conditionedValue)
+end
@@ -2,25 +2,150 @@ local dirOfThisFile = (...):match("(.-)[^%.]+$")
 
 local trace = require(dirOfThisFile .. "trace")
 local util = require(dirOfThisFile .. "util")
+local dump = require(dirOfThisFile .. "dump")
 
 module(..., package.seeall)
 
 
+-- Sample sinks consume samples as they are drawn, with add(sample, logprob, tr),
+-- so that queries over long runs do not have to keep every sample around.
+-- ('tr' is the trace the sample came from, when the sampler has one; see
+--  samplefile.sampleFileSink for a sink that uses it)
+
+-- The sink that samplers started by sampleInto should stream to
+local currentSink = nil
+
+-- Run samplingFn(computation, ...) and pass each of its samples to 'sink'
+-- Returns the sink
+-- (Samplers built on mcmc stream their samples straight into the sink; the
+--  samples of any other sampler, or of parallel chains, are passed to it
+--  from the list that the sampler returns.)
+-- (If the sampler raises an error, the previous sink is put back before
+--  the error is passed on)
+function sampleInto(sink, computation, samplingFn, ...)
+	local prevSink = currentSink
+	currentSink = sink
+	local ok, samps = pcall(samplingFn, computation, ...)
+	currentSink = prevSink
+	if not ok then
+		error(samps, 0)
+	end
+	if samps then
+		for i,s in ipairs(samps) do
+			sink:add(s.sample, s.logprob)
+		end
+	end
+	return sink
+end
+
+-- Sink that calls fn(sample, logprob, tr) for each sample
+local CallbackSink = {}
+
+function CallbackSink:new(fn)
+	local newobj = { fn = fn }
+	setmetatable(newobj, self)
+	self.__index = self
+	return newobj
+end
+
+function CallbackSink:add(sample, logprob, tr)
+	self.fn(sample, logprob, tr)
+end
+
+-- Sink that counts how often each value is sampled
+local HistogramSink = {}
+
+function HistogramSink:new()
+	local newobj = { counts = {}, n = 0 }
+	setmetatable(newobj, self)
+	self.__index = self
+	return newobj
+end
+
+function HistogramSink:add(sample, logprob)
+	self.counts[sample] = (self.counts[sample] or 0) + 1
+	self.n = self.n + 1
+end
+
+-- The fraction of samples that took each value
+function HistogramSink:distribution()
+	local hist = {}
+	for s,n in pairs(self.counts) do
+		hist[s] = n / self.n
+	end
+	return hist
+end
+
+-- Sink that accumulates the mean of the samples, which must be numbers or
+-- overload + and /; for numbers, it also keeps their variance (using
+-- Welford's online update)
+local MeanSink = {}
+
+function MeanSink:new()
+	local newobj = { sum = nil, n = 0, runningMean = 0, m2 = 0 }
+	setmetatable(newobj, self)
+	self.__index = self
+	return newobj
+end
+
+function MeanSink:add(sample, logprob)
+	local n = self.n + 1
+	self.n = n
+	self.sum = (n == 1) and sample or self.sum + sample
+	if type(sample) == "number" then
+		local d = sample - self.runningMean
+		self.runningMean = self.runningMean + d/n
+		self.m2 = self.m2 + d*(sample - self.runningMean)
+	end
+end
+
+function MeanSink:mean()
+	return self.sum / self.n
+end
+
+-- (The unbiased sample variance)
+function MeanSink:variance()
+	return self.m2 / (self.n - 1)
+end
+
+-- Sink that keeps the sample with the highest log probability
+local MAPSink = {}
+
+function MAPSink:new()
+	local newobj = { sample = nil, logprob = -math.huge }
+	setmetatable(newobj, self)
+	self.__index = self
+	return newobj
+end
+
+function MAPSink:add(sample, logprob)
+	if logprob > self.logprob then
+		self.sample = sample
+		self.logprob = logprob
+	end
+end
+
+function callbackSink(fn)
+	return CallbackSink:new(fn)
+end
+
+function histogramSink()
+	return HistogramSink:new()
+end
+
+function meanSink()
+	return MeanSink:new()
+end
+
+function mapSink()
+	return MAPSink:new()
+end
+
 -- Compute the discrete distribution over the given computation
 -- Only appropriate for computations that return a discrete value
 -- (Variadic arguments are arguments to the sampling function)
 function distrib(computation, samplingFn, ...)
-	local hist = {}
-	local samps = samplingFn(computation, ...)
-	for i,s in ipairs(samps) do
-		local prevval = hist[s.sample] or 0
-		hist[s.sample] = prevval + 1
-	end
-	local numsamps = table.getn(samps)
-	for s,n in pairs(hist) do
-		hist[s] = hist[s] / numsamps
-	end
-	return hist
+	return sampleInto(HistogramSink:new(), computation, samplingFn, ...):distribution()
 end
 
 -- Compute the mean of a set of values
@@ -36,20 +161,12 @@ end
 -- Compute the expected value of a computation
 -- Only appropraite for computations whose return value is a number or overloads + and /
 function expectation(computation, samplingFn, ...)
-	local samps = samplingFn(computation, ...)
-	return mean(util.map(function(s) return s.sample end, samps))
+	return sampleInto(MeanSink:new(), computation, samplingFn, ...):mean()
 end
 
 -- Maximum a posteriori inference (returns the highest probability sample)
 function MAP(computation, samplingFn, ...)
-	local samps = samplingFn(computation, ...)
-	local maxelem = {sample = nil, logprob = -math.huge}
-	for i,s in ipairs(samps) do
-		if s.logprob > maxelem.logprob then
-			maxelem = s
-		end
-	end
-	return maxelem.sample
+	return sampleInto(MAPSink:new(), computation, samplingFn, ...).sample
 end
 
 -- Rejection sample a result from computation that satisfies all
@@ -60,16 +177,70 @@ function rejectionSample(computation)
 end
 
 
+-- Whether 'name' is a free variable of 'tr' of the given kinds
+local function isFreeVar(tr, name, structural, nonstructural)
+	return (structural ~= false and tr.freeStructural.pos[name] ~= nil) or
+		   (nonstructural ~= false and tr.freeNonstructural.pos[name] ~= nil)
+end
+
+-- log(sum(exp(lps[i])))
+local function logsumexp(lps)
+	local maxlp = -math.huge
+	for i,lp in ipairs(lps) do
+		maxlp = math.max(maxlp, lp)
+	end
+	if maxlp == -math.huge then
+		return maxlp
+	end
+	local sum = 0
+	for i,lp in ipairs(lps) do
+		sum = sum + math.exp(lp - maxlp)
+	end
+	return maxlp + math.log(sum)
+end
+
 -- MCMC transition kernel that takes random walks by tweaking a
 -- single variable at a time
+-- If 'inPlace' is true, proposals change the current trace directly and
+-- are rolled back if rejected, instead of being made on a copy
+-- While 'adapting' is true (during burn-in; see mcmc), the step size of each
+-- variable's drift kernel is tuned toward 'targetAcceptance'
+-- 'proposals' (optional) changes how non-structural variables are proposed
+-- to (for traces only, not LARJ interpolations):
+--   blockSize = K: also change K-1 other non-structural variables, chosen
+--     at random, in the same run of the computation
+--   blocks = {{name, ...}, ...}: also change the rest of the variable's
+--     block (names as returned by freeVarNames; blocks should only hold
+--     non-structural variables)
+--   gibbs = true: Gibbs updates for variables whose ERP has finite support
+--     (see gibbsStep); other variables still get the proposals above
 local RandomWalkKernel = {}
 
-function RandomWalkKernel:new(structural, nonstructural)
+function RandomWalkKernel:new(structural, nonstructural, inPlace, proposals)
 	structural = (structural == nil) and true or structural
 	nonstructural = (nonstructural == nil) and true or nonstructural
+	inPlace = (inPlace == nil) and false or inPlace
+	proposals = proposals or {}
+	local blockOf = nil
+	if proposals.blocks then
+		blockOf = {}
+		for i,block in ipairs(proposals.blocks) do
+			for j,name in ipairs(block) do
+				blockOf[name] = block
+			end
+		end
+	end
 	local newobj = {
 		structural = structural,
 		nonstructural = nonstructural,
+		inPlace = inPlace,
+		blockSize = proposals.blockSize or 1,
+		blockOf = blockOf,
+		gibbs = proposals.gibbs or false,
+		adapting = false,
+		targetAcceptance = 0.44,
+		minLogScale = math.log(0.001),
+		maxLogScale = math.log(10),
 		proposalsMade = 0,
 		proposalsAccepted = 0
 	}
@@ -78,9 +249,43 @@ function RandomWalkKernel:new(structural, nonstructural)
 	return newobj
 end
 
+function RandomWalkKernel:setAdapting(adapting)
+	self.adapting = adapting
+end
+
+-- Count a proposal to a variable with drift statistics 'stats', and
+-- during burn-in nudge its step size multiplier up after acceptances and
+-- down after rejections (a Robbins-Monro update of log(scale), so the
+-- acceptance rate settles at targetAcceptance)
+-- (log(scale) is kept within [minLogScale, maxLogScale]: a variable whose
+--  proposals are always accepted would otherwise grow its steps without
+--  bound)
+function RandomWalkKernel:updateProposalStats(stats, accepted)
+	stats.proposed = stats.proposed + 1
+	if accepted then
+		stats.accepted = stats.accepted + 1
+	end
+	if self.adapting then
+		local err = (accepted and 1 or 0) - self.targetAcceptance
+		local logscale = math.log(stats.scale) + err / math.sqrt(stats.proposed)
+		stats.scale = math.exp(math.max(self.minLogScale, math.min(self.maxLogScale, logscale)))
+	end
+end
+
 function RandomWalkKernel:next(currTrace)
+	local nextTrace, stats, accepted = self:step(currTrace)
+	if stats then
+		self:updateProposalStats(stats, accepted)
+	end
+	return nextTrace
+end
+
+-- Returns the next trace, the proposal statistics of the variable that
+-- was changed (if it has any) and whether the change was accepted
+function RandomWalkKernel:step(currTrace)
 	self.proposalsMade = self.proposalsMade + 1
-	local name = util.randomChoice(currTrace:freeVarNames(self.structural, self.nonstructural))
+	local random = currTrace.random
+	local name = currTrace:randomFreeVarName(self.structural, self.nonstructural, random)
 
 	-- If we have no free random variables, then just run the computation
 	-- and generate another sample (this may not actually be deterministic,
@@ -88,20 +293,156 @@ function RandomWalkKernel:next(currTrace)
 	if not name then
 		currTrace:traceUpdate(not self.structural)
 		return currTrace
+	end
 	-- Otherwise, make a proposal for a randomly-chosen variable, probabilistically
 	-- accept it
+	-- (The statistics table is shared by every copy of the variable's record,
+	--  so it can be read here, before the proposal is made)
+	local var = currTrace:readRecord(name)
+	local stats = var.proposalStats
+	if not var.structural then
+		local support = self.gibbs and var.erp:support(var.params)
+		if support then
+			return self:gibbsStep(currTrace, name, var, support)
+		elseif self.blockOf or self.blockSize > 1 then
+			return self:blockStep(currTrace, name)
+		end
+	end
+	local scale = stats and stats.scale
+	if self.inPlace then
+		local currLogprob = currTrace.logprob
+		local currNumVars = currTrace:numFreeVars(self.structural, self.nonstructural)
+		local fwdPropLP, rvsPropLP = currTrace:proposeChangeInPlace(name, not self.structural, scale)
+		fwdPropLP = fwdPropLP - math.log(currNumVars)
+		rvsPropLP = rvsPropLP - math.log(currTrace:numFreeVars(self.structural, self.nonstructural))
+		local acceptThresh = currTrace.logprob - currLogprob + rvsPropLP - fwdPropLP
+		if currTrace.conditionsSatisfied and math.log(random()) < acceptThresh then
+			self.proposalsAccepted = self.proposalsAccepted + 1
+			currTrace:acceptChanges()
+			return currTrace, stats, true
+		else
+			currTrace:rejectChanges()
+			return currTrace, stats, false
+		end
 	else
-		local nextTrace, fwdPropLP, rvsPropLP = currTrace:proposeChange(name, not self.structural)
-		fwdPropLP = fwdPropLP - math.log(table.getn(currTrace:freeVarNames(self.structural, self.nonstructural)))
-		rvsPropLP = rvsPropLP - math.log(table.getn(nextTrace:freeVarNames(self.structural, self.nonstructural)))
+		local nextTrace, fwdPropLP, rvsPropLP = currTrace:proposeChange(name, not self.structural, scale)
+		fwdPropLP = fwdPropLP - math.log(currTrace:numFreeVars(self.structural, self.nonstructural))
+		rvsPropLP = rvsPropLP - math.log(nextTrace:numFreeVars(self.structural, self.nonstructural))
 		local acceptThresh = nextTrace.logprob - currTrace.logprob + rvsPropLP - fwdPropLP
-		if nextTrace.conditionsSatisfied and math.log(math.random()) < acceptThresh then
+		if nextTrace.conditionsSatisfied and math.log(random()) < acceptThresh then
 			self.proposalsAccepted = self.proposalsAccepted + 1
-			return nextTrace
+			return nextTrace, stats, true
+		else
+			return currTrace, stats, false
+		end
+	end
+end
+
+-- Log probability of choosing a block of 'k' variables of 'tr', given how
+-- blockStep chooses them
+function RandomWalkKernel:blockSelectionLP(tr, k)
+	local lp = math.log(k) - math.log(tr:numFreeVars(self.structural, self.nonstructural))
+	if not self.blockOf then
+		lp = lp - erpmath.lchoose(tr:numFreeVars(false, true) - 1, k - 1)
+	end
+	return lp
+end
+
+-- Change the non-structural variable 'name' together with the other
+-- variables of its block, in one run of the computation
+-- (Updates the proposal statistics itself, so returns just the next trace)
+function RandomWalkKernel:blockStep(currTrace, name)
+	local random = currTrace.random
+	local names = {name}
+	if self.blockOf then
+		local block = self.blockOf[name] or names
+		for i,other in ipairs(block) do
+			if other ~= name and isFreeVar(currTrace, other, false, true) then
+				table.insert(names, other)
+			end
+		end
+	else
+		local k = math.min(self.blockSize, currTrace:numFreeVars(false, true))
+		local chosen = {[name] = true}
+		while table.getn(names) < k do
+			local other = currTrace:randomFreeVarName(false, true, random)
+			if not chosen[other] then
+				chosen[other] = true
+				table.insert(names, other)
+			end
+		end
+	end
+	local k = table.getn(names)
+	local stats, scales = {}, {}
+	for i=1,k do
+		stats[i] = currTrace:readRecord(names[i]).proposalStats
+		scales[i] = stats[i] and stats[i].scale
+	end
+	-- Only non-structural variables change, so the structure stays fixed
+	local nextTrace, fwdPropLP, rvsPropLP
+	local currLogprob = currTrace.logprob
+	local fwdSelectLP = self:blockSelectionLP(currTrace, k)
+	if self.inPlace then
+		nextTrace = currTrace
+		fwdPropLP, rvsPropLP = currTrace:proposeBlockChangeInPlace(names, true, scales)
+	else
+		nextTrace, fwdPropLP, rvsPropLP = currTrace:proposeBlockChange(names, true, scales)
+	end
+	fwdPropLP = fwdPropLP + fwdSelectLP
+	rvsPropLP = rvsPropLP + self:blockSelectionLP(nextTrace, k)
+	local acceptThresh = nextTrace.logprob - currLogprob + rvsPropLP - fwdPropLP
+	local accepted = nextTrace.conditionsSatisfied and math.log(random()) < acceptThresh
+	if accepted then
+		self.proposalsAccepted = self.proposalsAccepted + 1
+	end
+	if self.inPlace then
+		if accepted then
+			currTrace:acceptChanges()
 		else
-			return currTrace
+			currTrace:rejectChanges()
+		end
+	elseif not accepted then
+		nextTrace = currTrace
+	end
+	for i=1,k do
+		if stats[i] then
+			self:updateProposalStats(stats[i], accepted)
+		end
+	end
+	return nextTrace
+end
+
+-- Gibbs update of the non-structural variable 'name' (whose record is
+-- 'var'), whose ERP can only take the values in 'support': scores the trace
+-- with each value (one run of the computation per value other than the
+-- current one, rolled back in place) and draws the new value from the exact
+-- conditional distribution, so the update is never rejected
+function RandomWalkKernel:gibbsStep(currTrace, name, var, support)
+	local currval = var.val
+	local weights = {}
+	for i,val in ipairs(support) do
+		weights[i] = (val == currval) and currTrace.logprob or currTrace:scoreValue(name, val)
+	end
+	local total = logsumexp(weights)
+	local u = currTrace.random()
+	local newval = currval
+	for i,val in ipairs(support) do
+		if weights[i] > -math.huge then
+			newval = val
+			u = u - math.exp(weights[i] - total)
+			if u <= 0 then
+				break
+			end
 		end
 	end
+	self.proposalsAccepted = self.proposalsAccepted + 1
+	if newval == currval then
+		return currTrace
+	end
+	local nextTrace = self.inPlace and currTrace or currTrace:deepcopy()
+	nextTrace:setVarValue(nextTrace:getRecord(name), newval)
+	nextTrace:traceUpdate(true)
+	return nextTrace
 end
 
 function RandomWalkKernel:stats()
@@ -115,7 +456,8 @@ local LARJInterpolationTrace = {
 	properties = {
 		logprob = function(self) return (1-self.alpha)*self.trace1.logprob + self.alpha*self.trace2.logprob end,
 		conditionsSatisfied = function(self) return self.trace1.conditionsSatisfied and self.trace2.conditionsSatisfied end,
-		returnValue = function(self) return trace2.returnValue end
+		returnValue = function(self) return trace2.returnValue end,
+		random = function(self) return self.trace1.random end
 	}
 }
 
@@ -124,20 +466,44 @@ function LARJInterpolationTrace:__index(key)
 	return v ~= nil and v or LARJInterpolationTrace.properties[key](self)
 end
 
-function LARJInterpolationTrace:new(trace1, trace2, alpha)
+-- The number of free variables of either trace (of the given kinds; see
+-- RandomExecutionTrace:numFreeVars), counting those in both only once
+local function unionFreeVarCount(trace1, trace2, structural, nonstructural)
+	local n = trace1:numFreeVars(structural, nonstructural)
+	for i,name in ipairs(trace2:freeVarNames(structural, nonstructural)) do
+		if not isFreeVar(trace1, name, structural, nonstructural) then
+			n = n + 1
+		end
+	end
+	return n
+end
+
+-- 'numFree' (optional) is the numFree table of an interpolation between
+-- traces with the same structure as these
+-- (Annealing only changes non-structural variables, with the structure of
+--  both traces fixed, so the number of free variables in the union does not
+--  change; it is counted once here, for each kind of variable, and shared
+--  with the interpolations that proposeChange makes)
+function LARJInterpolationTrace:new(trace1, trace2, alpha, numFree)
 	alpha = alpha or 0
+	if not numFree then
+		numFree = {[true] = {}, [false] = {[false] = 0}}
+		numFree[true][true] = unionFreeVarCount(trace1, trace2, true, true)
+		numFree[true][false] = unionFreeVarCount(trace1, trace2, true, false)
+		numFree[false][true] = unionFreeVarCount(trace1, trace2, false, true)
+	end
 	local newobj = {
 		trace1 = trace1,
 		trace2 = trace2,
-		alpha = alpha
+		alpha = alpha,
+		numFree = numFree
 	}
 	setmetatable(newobj, self)
 	return newobj
 end
 
+-- The free variables of the interpolation are those of either trace
 function LARJInterpolationTrace:freeVarNames(structural, nonstructural)
-	structural = (structural == nil) and true or structural
-	nonstructural = (nonstructural == nil) and true or nonstructural
 	local fv1 = self.trace1:freeVarNames(structural, nonstructural)
 	local fv2 = self.trace2:freeVarNames(structural, nonstructural)
 	local set = {}
@@ -150,20 +516,51 @@ function LARJInterpolationTrace:freeVarNames(structural, nonstructural)
 	return util.keys(set)
 end
 
-function LARJInterpolationTrace:proposeChange(varname, structureIsFixed)
+function LARJInterpolationTrace:numFreeVars(structural, nonstructural)
+	return self.numFree[structural ~= false][nonstructural ~= false]
+end
+
+-- (Picks uniformly from the free variables of both traces, trying again if
+--  it picks a variable of trace2 that trace1 also has)
+function LARJInterpolationTrace:randomFreeVarName(structural, nonstructural, random)
+	local n1 = self.trace1:numFreeVars(structural, nonstructural)
+	local n2 = self.trace2:numFreeVars(structural, nonstructural)
+	if n1 + n2 == 0 then
+		return nil
+	end
+	while true do
+		if random(n1 + n2) <= n1 then
+			return self.trace1:randomFreeVarName(structural, nonstructural, random)
+		end
+		local name = self.trace2:randomFreeVarName(structural, nonstructural, random)
+		if not isFreeVar(self.trace1, name, structural, nonstructural) then
+			return name
+		end
+	end
+end
+
+function LARJInterpolationTrace:getRecord(varname)
+	return self.trace1:getRecord(varname) or self.trace2:getRecord(varname)
+end
+
+function LARJInterpolationTrace:readRecord(varname)
+	return self.trace1:readRecord(varname) or self.trace2:readRecord(varname)
+end
+
+function LARJInterpolationTrace:proposeChange(varname, structureIsFixed, scale)
 	assert(structureIsFixed)
-	local var1 = self.trace1:getRecord(varname)
-	local var2 = self.trace2:getRecord(varname)
+	local var1 = self.trace1:readRecord(varname)
+	local var2 = self.trace2:readRecord(varname)
 	local nextTrace = LARJInterpolationTrace:new(var1 and self.trace1:deepcopy() or self.trace1,
 												 var2 and self.trace2:deepcopy() or self.trace2,
-												 self.alpha)
+												 self.alpha, self.numFree)
 	var1 = nextTrace.trace1:getRecord(varname)
 	var2 = nextTrace.trace2:getRecord(varname)
 	local var = var1 or var2
 	assert(not var.structural) 	-- We're only suposed to be making changes to non-structurals here
-	local propval = var.erp:proposal(var.val, var.params)
-	local fwdPropLP = var.erp:logProposalProb(var.val, propval, var.params)
-	local rvsPropLP = var.erp:logProposalProb(propval, var.val, var.params)
+	local propval = var.erp:proposal(var.val, var.params, self.random, scale)
+	local fwdPropLP = var.erp:logProposalProb(var.val, propval, var.params, scale)
+	local rvsPropLP = var.erp:logProposalProb(propval, var.val, var.params, scale)
 	if var1 then
 		var1.val = propval
 		var1.logprob = var1.erp:logprob(var1.val, var1.params)
@@ -177,6 +574,38 @@ function LARJInterpolationTrace:proposeChange(varname, structureIsFixed)
 	return nextTrace, fwdPropLP, rvsPropLP
 end
 
+function LARJInterpolationTrace:proposeChangeInPlace(varname, structureIsFixed, scale)
+	assert(structureIsFixed)
+	self.trace1:beginChanges()
+	self.trace2:beginChanges()
+	local var1 = self.trace1:readRecord(varname)
+	local var2 = self.trace2:readRecord(varname)
+	local var = var1 or var2
+	assert(not var.structural) 	-- We're only suposed to be making changes to non-structurals here
+	local propval = var.erp:proposal(var.val, var.params, self.random, scale)
+	local fwdPropLP = var.erp:logProposalProb(var.val, propval, var.params, scale)
+	local rvsPropLP = var.erp:logProposalProb(propval, var.val, var.params, scale)
+	if var1 then
+		self.trace1:setVarValue(self.trace1:getRecord(varname), propval)
+		self.trace1:traceUpdate(structureIsFixed)
+	end
+	if var2 then
+		self.trace2:setVarValue(self.trace2:getRecord(varname), propval)
+		self.trace2:traceUpdate(structureIsFixed)
+	end
+	return fwdPropLP, rvsPropLP
+end
+
+function LARJInterpolationTrace:acceptChanges()
+	self.trace1:acceptChanges()
+	self.trace2:acceptChanges()
+end
+
+function LARJInterpolationTrace:rejectChanges()
+	self.trace1:rejectChanges()
+	self.trace2:rejectChanges()
+end
+
 
 -- MCMC transition kernel that does reversible jumps using the LARJ algorithm
 local LARJKernel = {}
@@ -198,9 +627,13 @@ function LARJKernel:new(diffusionKernel, annealSteps, jumpFreq)
 	return newobj
 end
 
+function LARJKernel:setAdapting(adapting)
+	self.diffusionKernel:setAdapting(adapting)
+end
+
 function LARJKernel:next(currTrace)
-	local numStruct = table.getn(currTrace:freeVarNames(true, false))
-	local numNonStruct = table.getn(currTrace:freeVarNames(false, true))
+	local numStruct = currTrace:numFreeVars(true, false)
+	local numNonStruct = currTrace:numFreeVars(false, true)
 
 	-- If we have no free random variables, then just run the computation
 	-- and generate another sample (this may not actually be deterministic,
@@ -211,7 +644,7 @@ function LARJKernel:next(currTrace)
 	end
 	-- Decide whether to jump or diffuse
 	local structChoiceProp = self.jumpFreq or numStruct/(numStruct+numNonStruct)
-	if math.random() < structChoiceProp then
+	if currTrace.random() < structChoiceProp then
 		-- Make a structural proposal
 		return self:jumpStep(currTrace)
 	else
@@ -230,23 +663,22 @@ function LARJKernel:jumpStep(currTrace)
 	local newStructTrace = currTrace:deepcopy()
 
 	-- Randomly choose a structural variable to change
-	local structVars = newStructTrace:freeVarNames(true, false)
-	local name = util.randomChoice(structVars)
+	local oldNumVars = newStructTrace:numFreeVars(true, false)
+	local name = newStructTrace:randomFreeVarName(true, false, currTrace.random)
 	local var = newStructTrace:getRecord(name)
 	local origval = var.val
-	local propval = var.erp:proposal(var.val, var.params)
+	local propval = var.erp:proposal(var.val, var.params, currTrace.random)
 	local fwdPropLP = var.erp:logProposalProb(var.val, propval, var.params)
 	var.val = propval
 	var.logprob = var.erp:logprob(var.val, var.params)
 	newStructTrace:traceUpdate()
-	local oldNumVars = table.getn(structVars)
-	local newNumVars = table.getn(newStructTrace:freeVarNames(true, false))
+	local newNumVars = newStructTrace:numFreeVars(true, false)
 	fwdPropLP = fwdPropLP + newStructTrace.newlogprob - math.log(oldNumVars)
 
 	-- We only actually do annealing if we have any non-structural variables and we're
 	-- doing more than zero annealing steps
 	local annealingLpRatio = 0
-	if table.getn(oldStructTrace:freeVarNames(false, true)) + table.getn(newStructTrace:freeVarNames(false, true)) ~= 0
+	if oldStructTrace:numFreeVars(false, true) + newStructTrace:numFreeVars(false, true) ~= 0
 		and self.annealSteps > 0 then
 		local lerpTrace = LARJInterpolationTrace:new(oldStructTrace, newStructTrace)
 		local prevAccepted = self.diffusionKernel.proposalsAccepted
@@ -263,10 +695,10 @@ function LARJKernel:jumpStep(currTrace)
 	end
 
 	-- Finalize accept/reject decision
-	var = newStructTrace:getRecord(name)
+	var = newStructTrace:readRecord(name)
 	local rvsPropLP = var.erp:logProposalProb(propval, origval, var.params) + oldStructTrace:lpDiff(newStructTrace) - math.log(newNumVars)
 	local acceptanceProb = newStructTrace.logprob - currTrace.logprob + rvsPropLP - fwdPropLP + annealingLpRatio
-	if newStructTrace.conditionsSatisfied and math.log(math.random()) < acceptanceProb then
+	if newStructTrace.conditionsSatisfied and math.log(currTrace.random()) < acceptanceProb then
 		self.jumpProposalsAccepted = self.jumpProposalsAccepted + 1
 		return newStructTrace
 	else
@@ -295,15 +727,35 @@ end
 
 
 -- Do MCMC for 'numsamps' iterations using a given transition kernel
-function mcmc(computation, kernel, numsamps, lag, verbose)
+-- The first 'burnin' iterations (default 0) are not sampled from; the
+-- kernel adapts its proposals during them
+-- Returns the list of samples, unless they go to a sink: either 'sink', or
+-- the one given to sampleInto, if this is the sampler it started
+function mcmc(computation, kernel, numsamps, lag, verbose, burnin, sink)
 	lag = (lag == nil) and 1 or lag
+	burnin = (burnin == nil) and 0 or burnin
+	-- (Samplers run by the computation itself, as in nested queries, do not
+	--  see the sink)
+	sink = sink or currentSink
+	currentSink = nil
 	local currentTrace = trace.newTrace(computation)
-	local samps = {}
+	if burnin > 0 then
+		kernel:setAdapting(true)
+		for i=1,burnin do
+			currentTrace = kernel:next(currentTrace)
+		end
+		kernel:setAdapting(false)
+	end
+	local samps = not sink and {} or nil
 	local iters = numsamps * lag
 	for i=1,iters do
 		currentTrace = kernel:next(currentTrace)
 		if i % lag == 0 then
-			table.insert(samps, {sample = currentTrace.returnValue, logprob = currentTrace.logprob})
+			if sink then
+				sink:add(currentTrace.returnValue, currentTrace.logprob, currentTrace)
+			else
+				table.insert(samps, {sample = currentTrace.returnValue, logprob = currentTrace.logprob})
+			end
 		end
 	end
 	if verbose then
@@ -313,19 +765,92 @@ function mcmc(computation, kernel, numsamps, lag, verbose)
 end
 
 
+-- Chunk run by each parallel chain, in its own Lua state.
+-- Receives a dumped job table and returns the dumped samples.
+-- (The chain runs the sampler with the same options, except that it
+--  does not split into parallel chains again)
+local parallelChainWorker = [[
+local job = loadstring(...)()
+package.path, package.cpath = job.path, job.cpath
+local util = require(job.prefix .. "util")
+util.openpackage(util)
+util.openpackage(require(job.prefix .. "init"))
+local trace = require(job.prefix .. "trace")
+trace.setAddressMode(job.addressMode, job.checkCollisions)
+trace.setStorageMode(job.storageMode)
+math.random = math.newrandom(job.randomState)
+job.args[job.args.n].numchains = nil
+local sampler = require(job.prefix .. "inference")[job.sampler]
+local samps = sampler(job.computation, unpack(job.args, 1, job.args.n))
+return require(job.prefix .. "dump").DataDumper(samps, nil, true)
+]]
+
+-- Run opts.numchains independent chains of the named sampler at once,
+-- each on its own thread, and concatenate their samples.
+-- The sampler is called as sampler(computation, ..., opts).
+-- The computation is copied into each chain with dump.DataDumper, so
+-- its upvalues must be plain data or Lua functions; the library itself
+-- is available to it through globals, as after openpackage.
+local function parallelChains(samplerName, computation, opts, ...)
+	local addressMode, checkCollisions, storageMode = trace.getModes()
+	local args = {n = select("#", ...) + 1, ...}
+	args[args.n] = opts
+	local jobs = {}
+	for i=1,opts.numchains do
+		jobs[i] = dump.DataDumper(
+		{
+			computation = computation,
+			args = args,
+			sampler = samplerName,
+			randomState = math.randomstate(math.splitrandom(math.random)),
+			prefix = dirOfThisFile,
+			path = package.path,
+			cpath = package.cpath,
+			addressMode = addressMode,
+			checkCollisions = checkCollisions,
+			storageMode = storageMode
+		})
+	end
+	local samps = {}
+	for _,result in ipairs(parallel.run(parallelChainWorker, jobs)) do
+		for _,s in ipairs(loadstring(result)()) do
+			table.insert(samps, s)
+		end
+	end
+	return samps
+end
+
 -- Sample from a probabilistic computation for some
 -- number of iterations using single-variable-proposal
 -- Metropolis-Hastings 
-function traceMH(computation, numsamps, lag, verbose)
+-- 'opts' (optional) is a table of further options:
+--   inPlace = true: proposals are made in place (see RandomWalkKernel)
+--   numchains = N: N chains run in parallel, each drawing 'numsamps'
+--     samples (see parallelChains)
+--   burnin = B: proposal step sizes adapt during the first B iterations,
+--     which are not sampled from (see mcmc)
+--   proposals: block or Gibbs proposals (see RandomWalkKernel)
+function traceMH(computation, numsamps, lag, verbose, opts)
+	opts = opts or {}
+	if opts.numchains and opts.numchains > 1 then
+		return parallelChains("traceMH", computation, opts, numsamps, lag, verbose)
+	end
 	lag = (lag == nil) and 1 or lag
-	return mcmc(computation, RandomWalkKernel:new(), numsamps, lag, verbose)
+	return mcmc(computation, RandomWalkKernel:new(true, true, opts.inPlace, opts.proposals),
+				numsamps, lag, verbose, opts.burnin)
 end
 
 -- Sample from a probabilistic computation using locally
 -- annealed reversible jump mcmc
-function LARJMH(computation, numsamps, annealSteps, jumpFreq, lag, verbose)
+-- 'opts' takes inPlace, numchains and burnin, as for traceMH; they apply
+-- to the diffusion proposals
+function LARJMH(computation, numsamps, annealSteps, jumpFreq, lag, verbose, opts)
+	opts = opts or {}
+	if opts.numchains and opts.numchains > 1 then
+		return parallelChains("LARJMH", computation, opts, numsamps, annealSteps, jumpFreq, lag, verbose)
+	end
 	lag = (lag == nil) and 1 or lag
 	return mcmc(computation,
-				LARJKernel:new(RandomWalkKernel:new(false, true), annealSteps, jumpFreq),
-				numsamps, lag, verbose)
-end
\ No newline at end of file
+				LARJKernel:new(RandomWalkKernel:new(false, true, opts.inPlace), annealSteps, jumpFreq),
+				numsamps, lag, verbose, opts.burnin)
+end
@@ -5,12 +5,16 @@ local erp = require(dirOfThisFile .. "erp")
 local inference = require(dirOfThisFile .. "inference")
 local control = require(dirOfThisFile .. "control")
 local memoize = require(dirOfThisFile .. "memoize")
+local samplefile = require(dirOfThisFile .. "samplefile")
 
 module(...)
 
 -- Forward trace exports
 factor = trace.factor
 condition = trace.condition
+checkpoint = trace.checkpoint
+cachedFactor = trace.cachedFactor
+observe = trace.observe
 
 -- Forward ERP exports
 flip = erp.flip
@@ -24,12 +28,20 @@ beta = erp.beta
 binomial = erp.binomial
 poisson = erp.poisson
 dirichlet = erp.dirichlet
+multivariateGaussian = erp.multivariateGaussian
 
 -- Forward inference exports
 mean = inference.mean
 distrib = inference.distrib
 expectation = inference.expectation
 MAP = inference.MAP
+sampleInto = inference.sampleInto
+callbackSink = inference.callbackSink
+histogramSink = inference.histogramSink
+meanSink = inference.meanSink
+mapSink = inference.mapSink
+sampleFileSink = samplefile.sampleFileSink
+readSampleFile = samplefile.readSampleFile
 rejectionSample = inference.rejectionSample
 traceMH = inference.traceMH
 LARJMH = inference.LARJMH
@@ -0,0 +1,197 @@
+local ffi = require("ffi")
+
+module(..., package.seeall)
+
+
+-- Sample files store a chain in binary, one column of doubles per quantity:
+--   header (sample_file_header)
+--   column names, each terminated by a 0 byte, padded to a multiple of 8 bytes
+--   numcols columns of numrows doubles each, one after the other
+-- The first two columns are always "sample" and "logprob"; the rest hold
+-- the values of named random variables. Values that are not numbers are
+-- stored as NaN (booleans as 1 and 0).
+ffi.cdef[[
+typedef struct
+{
+	char magic[8];
+	uint32_t numcols;
+	uint32_t namebytes;
+	int64_t numrows;
+} sample_file_header;
+
+int open(const char *pathname, int flags);
+int close(int fd);
+int64_t lseek(int fd, int64_t offset, int whence);
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, int64_t offset);
+int munmap(void *addr, size_t length);
+]]
+
+local MAGIC = "PLSAMP1"
+local O_RDONLY = 0
+local SEEK_END = 2
+local PROT_READ = 1
+local MAP_PRIVATE = 2
+
+local NaN = 0/0
+
+-- Rows are buffered a block at a time
+local blockRows = 65536
+
+local function columnValue(val)
+	local t = type(val)
+	if t == "number" then
+		return val
+	elseif t == "boolean" then
+		return val and 1 or 0
+	else
+		return NaN
+	end
+end
+
+local function paddedNameBytes(namebytes)
+	return math.ceil(namebytes/8)*8
+end
+
+
+-- Sample sink (see inference.sampleInto) that writes its samples to a
+-- sample file, along with the values of the random variables named in
+-- 'varnames' (names as returned by a trace's freeVarNames; NaN in rows where
+-- the trace does not have the variable, or where no trace was given).
+-- Blocks of rows go to a temporary file as they fill up; close() gathers
+-- them into columns and writes the sample file itself.
+local SampleFileSink = {}
+
+function SampleFileSink:new(filename, varnames)
+	varnames = varnames or {}
+	local colnames = {"sample", "logprob"}
+	for i,name in ipairs(varnames) do
+		colnames[i+2] = tostring(name)
+	end
+	local tmpname = filename .. ".part"
+	local newobj = {
+		filename = filename,
+		tmpname = tmpname,
+		file = assert(io.open(tmpname, "wb")),
+		varnames = varnames,
+		colnames = colnames,
+		numcols = table.getn(colnames),
+		buffer = ffi.new("double[?]", table.getn(colnames)*blockRows),
+		blockFill = 0,
+		numrows = 0
+	}
+	setmetatable(newobj, self)
+	self.__index = self
+	return newobj
+end
+
+function SampleFileSink:add(sample, logprob, tr)
+	local buf = self.buffer
+	local i = self.blockFill
+	buf[i] = columnValue(sample)
+	buf[blockRows + i] = logprob
+	local varnames = self.varnames
+	for c=1,table.getn(varnames) do
+		buf[(c+1)*blockRows + i] = tr and columnValue(tr:varValue(varnames[c])) or NaN
+	end
+	self.blockFill = i + 1
+	self.numrows = self.numrows + 1
+	if self.blockFill == blockRows then
+		self:flushBlock()
+	end
+end
+
+-- Write out the buffered rows, one column after the other
+function SampleFileSink:flushBlock()
+	local fill = self.blockFill
+	for c=0,self.numcols-1 do
+		self.file:write(ffi.string(self.buffer + c*blockRows, fill*8))
+	end
+	self.blockFill = 0
+end
+
+-- Finish writing the sample file; returns the number of rows written
+function SampleFileSink:close()
+	if self.blockFill > 0 then
+		self:flushBlock()
+	end
+	self.file:close()
+	local names = table.concat(self.colnames, "\0") .. "\0"
+	local header = ffi.new("sample_file_header")
+	ffi.copy(header.magic, MAGIC)
+	header.numcols = self.numcols
+	header.namebytes = string.len(names)
+	header.numrows = self.numrows
+	local out = assert(io.open(self.filename, "wb"))
+	out:write(ffi.string(header, ffi.sizeof(header)))
+	out:write(names, string.rep("\0", paddedNameBytes(string.len(names)) - string.len(names)))
+	-- Each block holds blockRows rows of every column, except the last one
+	local blocks = assert(io.open(self.tmpname, "rb"))
+	local numrows, numcols = self.numrows, self.numcols
+	for c=0,numcols-1 do
+		local blockStart = 0
+		for row=0,numrows-1,blockRows do
+			local fill = math.min(blockRows, numrows - row)
+			blocks:seek("set", blockStart + c*fill*8)
+			out:write(blocks:read(fill*8))
+			blockStart = blockStart + numcols*fill*8
+		end
+	end
+	blocks:close()
+	out:close()
+	os.remove(self.tmpname)
+	return numrows
+end
+
+function sampleFileSink(filename, varnames)
+	return SampleFileSink:new(filename, varnames)
+end
+
+
+-- A sample file mapped into memory; 'columns' maps each column name to a
+-- double* to its 'numrows' values (indexed from 0). The pointers are valid
+-- until close() is called or the SampleFile is garbage collected.
+local SampleFile = {}
+
+function SampleFile:close()
+	if self.map then
+		ffi.C.munmap(ffi.gc(self.map, nil), self.size)
+		self.map = nil
+		self.columns = nil
+	end
+end
+
+function readSampleFile(filename)
+	local fd = ffi.C.open(filename, O_RDONLY)
+	if fd < 0 then
+		error("Could not open sample file " .. filename)
+	end
+	local size = tonumber(ffi.C.lseek(fd, 0, SEEK_END))
+	local addr = ffi.C.mmap(nil, size, PROT_READ, MAP_PRIVATE, fd, 0)
+	ffi.C.close(fd)
+	if addr == ffi.cast("void*", -1) then
+		error("Could not map sample file " .. filename)
+	end
+	local map = ffi.gc(ffi.cast("char*", addr), function(p) ffi.C.munmap(p, size) end)
+	local header = ffi.cast("sample_file_header*", map)
+	if size < ffi.sizeof("sample_file_header") or ffi.string(header.magic) ~= MAGIC then
+		error(filename .. " is not a sample file")
+	end
+	local numcols, numrows = header.numcols, tonumber(header.numrows)
+	local names = ffi.string(map + ffi.sizeof("sample_file_header"), header.namebytes)
+	local data = ffi.cast("double*", map + ffi.sizeof("sample_file_header") + paddedNameBytes(header.namebytes))
+	local newobj = {
+		map = map,
+		size = size,
+		numrows = numrows,
+		names = {},
+		columns = {}
+	}
+	for name in string.gmatch(names, "([^%z]*)%z") do
+		local c = table.getn(newobj.names)
+		newobj.names[c+1] = name
+		newobj.columns[name] = data + c*numrows
+	end
+	setmetatable(newobj, SampleFile)
+	SampleFile.__index = SampleFile
+	return newobj
+end
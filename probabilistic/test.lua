@@ -184,7 +184,7 @@ eqtest(
 		erp.binomial_logprob(20, .5, 40),
 		erp.binomial_logprob(30, .5, 40)
 	},
-	{-3.3234338674089985, -2.0722579911387817, -7.2840211276953575})
+	{-3.3081241144618296, -2.076480429147388, -7.167896429546097})
 
 test("poisson sample",
 	 replicate(runs,
@@ -452,6 +452,584 @@ mhtest(
 	end,
 	0.75)
 
+test("callsite is the same in compiled code",
+	 (function()
+	 	local function callsites()
+	 		local id1, pos1 = debug.callsite()
+	 		local id2, pos2 = debug.callsite(2)
+	 		return id1 + pos1 + id2 + pos2
+	 	end
+	 	-- Enough iterations for the loop to get compiled
+	 	local sites = {}
+	 	for i=1,200 do sites[i] = callsites() end
+	 	return util.map(function(s) return s - sites[1] end, sites)
+	 end)(),
+	 0,
+	 0)
+
+mhtest(
+	"checkpointed deterministic computation",
+	function()
+		local p = checkpoint(function(a, b) return a / (a + b) end, 3, 7)
+		return flip(p)
+	end,
+	0.3)
+
+local checkpointCalls = 0
+traceMH(function()
+			checkpoint(function(n) checkpointCalls = checkpointCalls + 1 end, 10)
+			return flip()
+		end, 100, 1)
+test("checkpointed computation runs once", {checkpointCalls}, 1, 0)
+
+mhtest(
+	"cached factor",
+	function()
+		local a = flip()
+		local b = flip()
+		cachedFactor(function(x) return (x == 1) and math.log(3) or 0 end, a)
+		return a
+	end,
+	0.75)
+
+trace.setAddressMode("hash", true)
+
+mhtest(
+	"recursive stochastic fn, unconditioned (hashed addresses)",
+	function()
+		local function powerLaw(prob, x)
+			if int2bool(flip(prob, true)) then
+				return x
+			else
+				return 0 + powerLaw(prob, x+1)
+			end
+		end
+		local a = powerLaw(0.3, 1)
+		return bool2int(a < 5)
+	end, 
+	0.7599)
+
+trace.setAddressMode("string")
+
+trace.setStorageMode("ffi")
+
+mhtest(
+	"trans-dimensional (FFI trace storage)",
+	function()
+		local a = int2bool(flip(0.9, true)) and beta(1,5) or 0.7
+		local b = flip(a)
+		condition(int2bool(b))
+		return a
+	end,
+	0.417)
+
+larjtest(
+	"trans-dimensional (LARJ, FFI trace storage)",
+	function()
+		local a = int2bool(flip(0.9, true)) and beta(1,5) or 0.7
+		local b = flip(a)
+		condition(int2bool(b))
+		return a
+	end,
+	0.417)
+
+trace.setStorageMode("table")
+
+test(
+	"multinomial conditioned on noisy observation (in-place MH)",
+	replicate(runs, function() return expectation(function()
+		local hyp = multinomialDraw({"b", "c", "d"}, {0.1, 0.6, 0.3})
+		local function observe(x)
+			if int2bool(flip(0.8)) then
+				return x
+			else
+				return "b"
+			end
+		end
+		condition(observe(hyp) == "b")
+		return bool2int(hyp == "b")
+	end, traceMH, samples, lag, false, {inPlace = true}) end),
+	0.357)
+
+test(
+	"trans-dimensional (LARJ, in-place proposals)",
+	replicate(runs, function() return expectation(function()
+		local a = int2bool(flip(0.9, true)) and beta(1,5) or 0.7
+		local b = flip(a)
+		condition(int2bool(b))
+		return a
+	end, LARJMH, samples, 10, nil, lag, false, {inPlace = true}) end),
+	0.417)
+
+local noiseProb = 0.8
+test(
+	"multinomial conditioned on noisy observation (parallel chains)",
+	replicate(runs, function() return expectation(function()
+		local hyp = multinomialDraw({"b", "c", "d"}, {0.1, 0.6, 0.3})
+		local function observe(x)
+			if int2bool(flip(noiseProb)) then
+				return x
+			else
+				return "b"
+			end
+		end
+		condition(observe(hyp) == "b")
+		return bool2int(hyp == "b")
+	end, traceMH, samples, lag, false, {numchains = 4}) end),
+	0.357)
+
+local function reproducedSamples(...)
+	math.randomseed(42)
+	local samps1 = traceMH(...)
+	math.randomseed(42)
+	local samps2 = traceMH(...)
+	return util.map(function(i) return math.abs(samps1[i].sample - samps2[i].sample) end,
+					util.keys(samps1))
+end
+test(
+	"parallel chains are reproducible from the seed",
+	reproducedSamples(function() return gaussian(0, 1) + poisson(3) end, 50, 1, false, {numchains = 4}),
+	0,
+	0)
+
+local batchData = {0.5, 1.5, 2.5, 4, 7}
+local ffi = require("ffi")
+eqtest(
+	"batched lp",
+	{
+		erp.primitives.gaussian:logprobBatch(batchData, {2, 1.5}),
+		erp.primitives.gamma:logprobBatch(ffi.new("double[5]", batchData), {2, 2}, 5),
+		erp.primitives.poisson:logprobBatch({2, 5, 7}, {4})
+	},
+	{
+		util.sum(util.map(function(x) return erp.gaussian_logprob(x, 2, 1.5) end, batchData)),
+		util.sum(util.map(function(x) return erp.gamma_logprob(x, 2, 2) end, batchData)),
+		-1.9205584583201643 - 1.8560199371825927 - 2.821100833226181
+	},
+	0.000000001)
+
+eqtest(
+	"batched flip lp with p = 0 or 1",
+	{
+		bool2int(erp.primitives.flip:logprobBatch({0, 0, 0}, {0}) == 0),
+		bool2int(erp.primitives.flip:logprobBatch({1, 1}, {1}) == 0),
+		bool2int(erp.primitives.flip:logprobBatch({1, 0}, {1}) == -math.huge)
+	},
+	{1, 1, 1},
+	0)
+
+eqtest(
+	"binomial lp with p = 0 or 1",
+	{
+		bool2int(erp.binomial_logprob(0, 0, 5) == 0),
+		bool2int(erp.binomial_logprob(5, 1, 5) == 0),
+		bool2int(erp.binomial_logprob(2, 0, 5) == -math.huge),
+		bool2int(erp.primitives.binomial:logprobBatch({0, 0}, {0, 5}) == 0),
+		bool2int(erp.primitives.binomial:logprobBatch({5, 5}, {1, 5}) == 0),
+		bool2int(erp.primitives.binomial:logprobBatch({0, 2}, {0, 5}) == -math.huge)
+	},
+	{1, 1, 1, 1, 1, 1},
+	0)
+
+test("batched gamma sample",
+	 replicate(runs,
+	 	function() return mean(erp.primitives.gamma:sampleBatch(samples, {2, 2}, math.random))/10 end),
+	0.4)
+
+local observedData = ffi.new("double[5]", {1.5, 2.5, 2, 1.8, 2.2})
+mhtest(
+	"observed dataset",
+	function()
+		local mu = gaussian(0, 5)
+		observe(erp.primitives.gaussian, {mu, 1}, observedData, 5)
+		return mu/10
+	end,
+	0.1984)
+
+local scalarTrace = trace.newTrace(function() return gaussian(0, 1) + gaussian(1, 2) end)
+local scalarParams = scalarTrace.varlist[2].params
+scalarTrace:traceUpdate()
+test("unchanged scalar parameters are not copied",
+	 {bool2int(scalarTrace.varlist[2].params == scalarParams)}, 1, 0)
+
+local sharingTrace = scalarTrace:deepcopy()
+local sharedName = scalarTrace.varlist[1].name
+local sharedVal = sharingTrace:readRecord(sharedName).val
+test("reading a record does not copy it",
+	 {bool2int(sharingTrace.vars[sharedName] == scalarTrace.vars[sharedName] and sharedVal == scalarTrace:varValue(sharedName))}, 1, 0)
+
+local manyWeights = {}
+for i=1,1000 do manyWeights[i] = i end
+test("multinomial sample, many categories",
+	 replicate(runs,
+	 	function() return mean(replicate(samples,
+	 		function() return multinomial(manyWeights)/1000 end))
+	 	end),
+	 2001/3000)
+
+mhtest(
+	"dirichlet posterior (log-ratio drift)",
+	function()
+		local theta = dirichlet({1, 1, 1})
+		factor(3*math.log(theta[1]) + math.log(theta[2]))
+		return theta[1]
+	end,
+	4/7)
+
+local dirichletDraw = dirichlet({1, 2, 3})
+eqtest("array helpers on vectors",
+	   {util.sum(dirichletDraw), #util.map(math.log, dirichletDraw), #util.filter(function(x) return x > 0 end, dirichletDraw)},
+	   {1, 3, 3},
+	   0.000000001)
+
+local keyedTable = {a = 1, b = 2, [5] = 3}
+local keyedEvens = util.filter(function(x) return x % 2 == 0 end, keyedTable)
+eqtest("array helpers on keyed tables",
+	   {util.sum(keyedTable), util.map(function(x) return 2*x end, keyedTable)[5], keyedEvens.b, #util.keys(keyedEvens)},
+	   {6, 6, 2, 1},
+	   0.000000001)
+
+local mvnMean = {0, 0}
+local mvnCov = {{1, 0.8}, {0.8, 1}}
+mhtest(
+	"multivariate gaussian conditioned on one component",
+	function()
+		local x = multivariateGaussian(mvnMean, mvnCov)
+		factor(erp.gaussian_logprob(1.5, x[2], 0.5))
+		return x[1]
+	end,
+	0.96,
+	0.15)
+
+-- (traceMH with 200 iterations of burn-in, during which drift step sizes adapt)
+function adaptivetest(name, computation, trueExpectation, tolerance)
+	test(name, replicate(runs, function() return expectation(computation, traceMH, samples, lag, false, {burnin = 200}) end),
+		 trueExpectation, tolerance)
+end
+
+adaptivetest(
+	"beta posterior (adapted logit drift)",
+	function()
+		local p = beta(2, 2)
+		factor(erp.binomial_logprob(7, p, 10))
+		return p
+	end,
+	9/14)
+
+adaptivetest(
+	"gamma posterior (adapted log drift)",
+	function()
+		local rate = gamma(2, 1)
+		factor(erp.poisson_logprob(3, rate) + erp.poisson_logprob(4, rate) + erp.poisson_logprob(2, rate))
+		return rate
+	end,
+	2.75,
+	0.2)
+
+-- (Every proposal to a flat uniform is accepted, so its step size grows
+--  for as long as burn-in lasts)
+test("long burn-in on an always-accepted variable",
+	 replicate(runs, function() return expectation(function() return uniform(0, 1) end,
+	 											   traceMH, samples, lag, false, {burnin = 2000}) end),
+	 0.5)
+
+local farProposals = replicate(1000, function() return erp.primitives.uniform:proposal(0.3, {0, 1}, math.random, 1e6) end)
+eqtest("uniform drift reflected from far away",
+	   {bool2int(math.min(unpack(farProposals)) >= 0 and math.max(unpack(farProposals)) <= 1), mean(farProposals)},
+	   {1, 0.5},
+	   0.05)
+
+local function correlatedGaussians()
+	local x = gaussian(0, 1)
+	local y = gaussian(x, 0.5)
+	factor(erp.gaussian_logprob(2, x + y, 0.3))
+	return x
+end
+
+test("block proposals",
+	 replicate(runs, function() return expectation(correlatedGaussians, traceMH, samples, lag, false, {proposals = {blockSize = 2}}) end),
+	 4/4.34)
+
+test("gibbs updates for discrete variables",
+	 replicate(runs,
+	 	function() return expectation(function()
+	 		local a = flip(0.3)
+	 		local b = flip(0.6)
+	 		local c = multinomial({0.2, 0.3, 0.5})
+	 		condition(a + b >= 1)
+	 		factor((c == 3 and a == 1) and 0 or -1)
+	 		return a
+	 	end, traceMH, samples, lag, false, {proposals = {gibbs = true}}) end),
+	 0.3*(0.2/math.exp(1) + 0.3/math.exp(1) + 0.5) /
+	 (0.3*(0.2/math.exp(1) + 0.3/math.exp(1) + 0.5) + 0.7*0.6/math.exp(1)))
+
+test("ziggurat exponential sample",
+	 replicate(runs,
+	 	function() return mean(replicate(samples, function() return erpmath.exponential(math.random, 4) end)) end),
+	 0.25)
+
+-- (3.442619855899 is where the ziggurat's base strip hands over to its tail
+--  sampler; the mean of |x| beyond it is phi(r)/Q(r))
+local function zigguratGaussianMoments(n)
+	local tailStart = 3.442619855899
+	local sum, sumsq, within1, tailCount, tailSum = 0, 0, 0, 0, 0
+	for i=1,n do
+		local x = erpmath.gaussian(math.random, 0, 1)
+		sum = sum + x
+		sumsq = sumsq + x*x
+		local ax = math.abs(x)
+		if ax < 1 then within1 = within1 + 1 end
+		if ax > tailStart then
+			tailCount = tailCount + 1
+			tailSum = tailSum + ax
+		end
+	end
+	return sum/n, sumsq/n - (sum/n)^2, within1/n, tailCount/n, tailSum/tailCount
+end
+local gaussMean, gaussVar, gaussWithin1, gaussTailMass, gaussTailMean = zigguratGaussianMoments(1000000)
+eqtest("ziggurat gaussian mean and variance", {gaussMean, gaussVar}, {0, 1}, 0.01)
+eqtest("ziggurat gaussian mass within one sd", {gaussWithin1}, {0.6826894921370859}, 0.003)
+eqtest("ziggurat gaussian tail mass", {gaussTailMass}, {0.0005761085123916405}, 0.0001)
+eqtest("ziggurat gaussian tail mean", {gaussTailMean}, {3.697317056219553}, 0.06)
+
+-- (Shape below 1 takes the boosting branch: gamma(1+a) * U^(1/a))
+local function zigguratGammaMoments(n, a, b)
+	local sum, sumsq, small = 0, 0, 0
+	for i=1,n do
+		local x = erpmath.gamma(math.random, a, b)
+		sum = sum + x
+		sumsq = sumsq + x*x
+		if x < 0.01 then small = small + 1 end
+	end
+	return sum/n, sumsq/n - (sum/n)^2, small/n
+end
+local gammaMean, gammaVar, gammaSmall = zigguratGammaMoments(1000000, 0.3, 2)
+eqtest("ziggurat gamma (shape < 1) mean", {gammaMean}, {0.6}, 0.006)
+eqtest("ziggurat gamma (shape < 1) variance", {gammaVar}, {1.2}, 0.03)
+eqtest("ziggurat gamma (shape < 1) mass below 0.01", {gammaSmall}, {0.2270753717704627}, 0.002)
+
+eqtest(
+	"scalar dispatch lp",
+	{
+		erp.primitives.gaussian:logprobArgs(0.5, 2, 1.5),
+		erp.primitives.flip:logprobArgs(1, 0.3),
+		erp.primitives.binomial:logprobArgs(3, 0.4, 10)
+	},
+	{
+		erp.primitives.gaussian:logprob(0.5, {2, 1.5}),
+		math.log(0.3),
+		erp.primitives.binomial:logprob(3, {0.4, 10})
+	})
+
+test("streamed variance",
+	 replicate(runs,
+	 	function() return sampleInto(meanSink(), function() return uniform(0, 4) end, traceMH, samples, lag):variance() end),
+	 4/3,
+	 0.25)
+
+local unDumpable = ffi.new("double[1]", 0.5)
+local failedQuery = pcall(expectation, function() return flip(unDumpable[0]) end,
+						  traceMH, 10, 1, false, {numchains = 2})
+test("sampler error does not leave the sink installed",
+	 {bool2int(not failedQuery and type(traceMH(function() return flip() end, 10, 1)) == "table")}, 1, 0)
+
+-- (Writes more rows than fit in one of the sink's blocks, and checks every
+--  column against the rows as they were drawn)
+local function sampleFileTest(numrows)
+	local computation = function()
+		local x = gaussian(2, 1)
+		local y = flip(0.3)
+		return x*x + y
+	end
+	local varnames = trace.newTrace(computation):freeVarNames()
+	local filename = os.tmpname()
+	local fileSink = sampleFileSink(filename, varnames)
+	local rows = {}
+	sampleInto(callbackSink(function(sample, logprob, tr)
+		fileSink:add(sample, logprob, tr)
+		table.insert(rows, {sample, logprob, tr:varValue(varnames[1]), tr:varValue(varnames[2])})
+	end), computation, traceMH, numrows, 1)
+	fileSink:close()
+	local file = readSampleFile(filename)
+	local columns = {file.columns.sample, file.columns.logprob,
+					 file.columns[tostring(varnames[1])], file.columns[tostring(varnames[2])]}
+	local mismatches = 0
+	for i=0,file.numrows-1 do
+		for c=1,4 do
+			if columns[c][i] ~= rows[i+1][c] then
+				mismatches = mismatches + 1
+			end
+		end
+	end
+	file:close()
+	os.remove(filename)
+	return {file.numrows, mismatches}
+end
+eqtest("sample file round trip", sampleFileTest(70000), {70000, 0}, 0)
+
+local indexTrace = trace.newTrace(function()
+	local k = flip(0.5, true)
+	for i=1,3+k do
+		gaussian(0, 1, false, (i == 2) and 0.5 or nil)
+	end
+end)
+local structuralName = indexTrace:randomFreeVarName(true, false, math.random)
+eqtest(
+	"free variable index",
+	{
+		indexTrace:numFreeVars(true, false),
+		indexTrace:numFreeVars(false, true),
+		indexTrace:numFreeVars(),
+		indexTrace:getRecord(structuralName).structural and 1 or 0
+	},
+	{1, 2 + indexTrace:getRecord(structuralName).val, 3 + indexTrace:getRecord(structuralName).val, 1})
+
+-- (Checks the index against the records themselves, as a structure-changing
+--  model is proposed to in place and on copies, with changes accepted and
+--  rejected, in both trace storage modes)
+local function freeVarIndexMismatches(tr)
+	local numStructural, numNonstructural = 0, 0
+	for name,_ in pairs(tr.vars) do
+		local rec = tr:readRecord(name)
+		if not rec.conditioned then
+			if rec.structural then
+				numStructural = numStructural + 1
+			else
+				numNonstructural = numNonstructural + 1
+			end
+		end
+	end
+	return bool2int(tr:numFreeVars(true, false) ~= numStructural) +
+		   bool2int(tr:numFreeVars(false, true) ~= numNonstructural) +
+		   bool2int(table.getn(tr:freeVarNames()) ~= numStructural + numNonstructural)
+end
+local function freeVarIndexTest(storageMode)
+	trace.setStorageMode(storageMode)
+	local tr = trace.newTrace(function()
+		local k = flip(0.5, true)
+		for i=1,3+2*k do
+			gaussian(0, 1, false, (i == 2) and 0.5 or nil)
+		end
+		if k == 1 then flip(0.5, true) end
+	end)
+	local mismatches = 0
+	for step=1,300 do
+		local name = tr:randomFreeVarName(true, true, math.random)
+		if step % 3 == 0 then
+			tr:proposeChangeInPlace(name, false)
+			mismatches = mismatches + freeVarIndexMismatches(tr)
+			if math.random() < 0.5 then tr:acceptChanges() else tr:rejectChanges() end
+		elseif step % 3 == 1 then
+			tr = tr:proposeChange(name, false)
+		else
+			local copy = tr:deepcopy()
+			copy:proposeChangeInPlace(name, false)
+			mismatches = mismatches + freeVarIndexMismatches(copy)
+			copy:rejectChanges()
+			mismatches = mismatches + freeVarIndexMismatches(copy)
+		end
+		mismatches = mismatches + freeVarIndexMismatches(tr)
+	end
+	trace.setStorageMode("table")
+	return mismatches
+end
+eqtest("free variable index after proposals", {freeVarIndexTest("table"), freeVarIndexTest("ffi")}, {0, 0}, 0)
+
+-- {function, arguments, true value}
+-- (lgamma is checked on the reflection branch below 0.5, and on both sides of
+--  the boundary at 256 between the table of factorials and the Lanczos series)
+local function lchooseIsNegInf(n, k) return bool2int(erpmath.lchoose(n, k) == -math.huge) end
+local specialFunctionCases =
+{
+	{erpmath.lgamma, {0.5}, 0.5723649429247004},
+	{erpmath.lgamma, {0.25}, 1.2880225246980772},
+	{erpmath.lgamma, {-0.5}, 1.265512123484645},
+	{erpmath.lgamma, {-2.5}, -0.05624371649767457},
+	{erpmath.lgamma, {255}, 1156.1708375732424},
+	{erpmath.lgamma, {256}, 1161.7121011184006},
+	{erpmath.lgamma, {256.5}, 1164.484201559701},
+	{erpmath.lgamma, {257}, 1167.2572785628802},
+	{erpmath.digamma, {1}, -0.5772156649015329},
+	{erpmath.digamma, {0.5}, -1.9635100260214235},
+	{erpmath.digamma, {-0.5}, 0.03648997397857652},
+	{erpmath.digamma, {10}, 2.251752589066721},
+	{erpmath.lfact, {3}, math.log(6)},
+	{erpmath.lfact, {255}, 1161.7121011184006},
+	{erpmath.lfact, {256}, 1167.2572785628802},
+	{erpmath.lbeta, {2.5, 0.5}, 0.1639006328376751},
+	{erpmath.lchoose, {10, 3}, 4.787491742782045},
+	{erpmath.lchoose, {300, 100}, 187.93448719709897},
+	{erpmath.lchoose, {5, 0}, 0},
+	{lchooseIsNegInf, {5, -1}, 1},
+	{lchooseIsNegInf, {5, 6}, 1}
+}
+-- The value of each case, from the last of 'reps' passes over all of them
+local function specialFunctionValues(reps)
+	local vals = {}
+	for rep=1,reps do
+		for i=1,table.getn(specialFunctionCases) do
+			local case = specialFunctionCases[i]
+			vals[i] = case[1](case[2][1], case[2][2])
+		end
+	end
+	return vals
+end
+local specialFunctionTrueValues = util.map(function(case) return case[3] end, specialFunctionCases)
+eqtest("special functions", specialFunctionValues(1), specialFunctionTrueValues, 0.000000001)
+eqtest("special functions (JIT-compiled calls)", specialFunctionValues(500), specialFunctionTrueValues, 0.000000001)
+
+-- (Runs a trace of the computation again with the address frame cache
+--  turned off, keeping its random choices, and counts the variables whose
+--  names are not the same as before)
+local function frameCacheNameMismatches(computation)
+	local cached = trace.newTrace(computation)
+	local uncached = cached:deepcopy()
+	uncached.addrcache = nil
+	uncached:traceUpdate()
+	local names = {}
+	for i,name in ipairs(cached:freeVarNames()) do
+		names[name] = true
+	end
+	local mismatches = math.abs(table.getn(cached:freeVarNames()) - table.getn(uncached:freeVarNames()))
+	for i,name in ipairs(uncached:freeVarNames()) do
+		if not names[name] then
+			mismatches = mismatches + 1
+		end
+	end
+	return mismatches
+end
+local function frameCacheModel()
+	local function tree(depth)
+		if depth == 0 or int2bool(flip(0.3, true)) then
+			return gaussian(0, 1)
+		end
+		local s = 0
+		for i=1,2 do
+			s = s + tree(depth - 1)
+		end
+		return s
+	end
+	local total = 0
+	for i=1,3 do
+		for j=1,poisson(2, true) do
+			total = total + tree(3) + gaussian(total, 1)
+		end
+	end
+	local sums = util.map(function(x) return x + gaussian(0, 1) end, {1, 2, 3})
+	return total + util.sum(sums)
+end
+local function frameCacheTest(addressMode)
+	trace.setAddressMode(addressMode)
+	local mismatches = 0
+	for i=1,20 do
+		mismatches = mismatches + frameCacheNameMismatches(frameCacheModel)
+	end
+	trace.setAddressMode("string")
+	return mismatches
+end
+eqtest("names with and without the address frame cache",
+	   {frameCacheTest("string"), frameCacheTest("hash")}, {0, 0}, 0)
+
 print("tests done!")
 
 local t2 = os.clock()
@@ -1,44 +1,163 @@
 local dirOfThisFile = (...):match("(.-)[^%.]+$")
 
 local util = require(dirOfThisFile .. "util")
+local ffi = require("ffi")
+local band, bor, bnot = bit.band, bit.bor, bit.bnot
 
 module(..., package.seeall)
 
 
+-- Proposal statistics of a variable whose ERP has a drift kernel (one with
+-- a 'driftScale'): the adapted step size multiplier 'scale', and how many
+-- proposals to the variable have been made and accepted.
+-- A variable keeps the same statistics table through all copies of its
+-- record, and changes to it are not undone by rejectChanges, since it
+-- describes the sampler rather than the sampled state.
+local function newProposalStats(erp)
+	return erp.driftScale and {scale = 1, proposed = 0, accepted = 0} or nil
+end
+
 -- Variables generated by ERPs
+-- Records are shared between a trace and its copies; 'owner' is the id of
+-- the only trace allowed to change the record in place, and 'active' is the
+-- id of the last trace run that reached it.
 local RandomVariableRecord = {}
 
-function RandomVariableRecord:new(name, erp, params, val, logprob, structural, conditioned)
+function RandomVariableRecord:new(name, erp, params, val, logprob, structural, conditioned, proposalStats)
 	conditioned = (conditioned == nil) and false or conditioned
+	proposalStats = proposalStats or newProposalStats(erp)
 	local newobj = { name = name, erp = erp, params = params, val = val, logprob = logprob,
-			   active = true, structural = structural, conditioned = conditioned }
+			   active = nil, owner = nil, structural = structural, conditioned = conditioned,
+			   proposalStats = proposalStats }
 	setmetatable(newobj, self)
 	self.__index = self
 	return newobj
 end
 
 function RandomVariableRecord:copy()
-	return RandomVariableRecord:new(self.name, self.erp, self.params, self.val, self.logprob,
-									self.structural, self.conditioned)
+	local newrec = RandomVariableRecord:new(self.name, self.erp, self.params, self.val, self.logprob,
+											self.structural, self.conditioned, self.proposalStats)
+	newrec.active = self.active
+	return newrec
+end
+
+-- Set of variable names with O(1) insertion, removal, count and uniform
+-- random choice: the names are packed into list[1..n], and 'pos' maps each
+-- one to its index in the list. Writes go through the undo log of the
+-- trace 'tr' that the set belongs to.
+local NameSet = {}
+
+function NameSet:new(list, pos, n)
+	local newobj = { list = list or {}, pos = pos or {}, n = n or 0 }
+	setmetatable(newobj, self)
+	self.__index = self
+	return newobj
+end
+
+function NameSet:copy()
+	return NameSet:new(util.copytable(self.list), util.copytable(self.pos), self.n)
+end
+
+function NameSet:add(name, tr)
+	local n = self.n + 1
+	tr:logWrite(self, "n")
+	tr:logWrite(self.list, n)
+	tr:logWrite(self.pos, name)
+	self.n = n
+	self.list[n] = name
+	self.pos[name] = n
+end
+
+-- (The last name in the list takes the place of the removed one)
+function NameSet:remove(name, tr)
+	local list, pos = self.list, self.pos
+	local i = pos[name]
+	local n = self.n
+	local last = list[n]
+	tr:logWrite(self, "n")
+	tr:logWrite(list, i)
+	tr:logWrite(list, n)
+	tr:logWrite(pos, last)
+	tr:logWrite(pos, name)
+	list[i] = last
+	pos[last] = i
+	list[n] = nil
+	pos[name] = nil
+	self.n = n - 1
+end
+
+-- Free (unconditioned) variables are indexed by name in one of two NameSets
+-- of their trace, 'freeStructural' and 'freeNonstructural'. This returns the
+-- key of the set that a variable with the given flags belongs in, if any.
+local function freeSetKey(structural, conditioned)
+	if conditioned then
+		return nil
+	end
+	return structural and "freeStructural" or "freeNonstructural"
+end
+
+-- Source of trace and run ids
+local lastId = 0
+local function newId()
+	lastId = lastId + 1
+	return lastId
+end
+
+
+-- Random variables are named by their structural address in the program.
+-- By default, names are strings like "123:45:0|678:9:0|" (one
+-- fnprotoid:bytecodepos:loopcount triple per frame). In 'hash' mode, names
+-- are instead 53-bit rolling hashes of the same addresses, stored as numbers,
+-- which keeps long name strings out of the VM's string table.
+local hashAddresses = false
+local checkAddressCollisions = false
+local hashedAddressNames = {}
+
+-- Switch between 'string' and 'hash' addressing for traces created from now on.
+-- If checkCollisions is true, every hashed name is also computed as a string
+-- and checked against the other strings that hashed to the same value.
+function setAddressMode(mode, checkCollisions)
+	assert(mode == "string" or mode == "hash", "Unknown address mode " .. tostring(mode))
+	hashAddresses = (mode == "hash")
+	checkAddressCollisions = hashAddresses and (checkCollisions or false)
+	hashedAddressNames = {}
 end
 
 
 -- Execution trace generated by a probabilistic program.
 -- Tracks the random choices made and accumulates probabilities
+-- 'random' is the generator stream that the trace's random choices are
+-- drawn from (see math.newrandom); copies of a trace share its stream.
 local RandomExecutionTrace = {}
 
-function RandomExecutionTrace:new(computation, doRejectionInit)
+function RandomExecutionTrace:new(computation, doRejectionInit, random)
 	doRejectionInit = (doRejectionInit == nil) and true or doRejectionInit
 	local newobj = {
 		computation = computation,
+		random = random,
 		vars = {},
 		varlist = {},
+		freeStructural = NameSet:new(),
+		freeNonstructural = NameSet:new(),
+		sharesVars = false,
+		sharesFreeVars = false,
+		sharesVarList = false,
+		varsOutOfSync = false,
+		id = newId(),
+		runid = nil,
+		checkpoints = {},
+		sharesCheckpoints = false,
+		checkpointDepth = 0,
 		currVarIndex = 1,
 		logprob = 0.0,
 		newlogprob = 0.0,
 		oldlogprob = 0.0,
 		rootframe = nil,
 		loopcounters = {},
+		addrcache = {},
+		hashNames = hashAddresses,
+		checkloopcounters = checkAddressCollisions and {} or nil,
+		checkaddrcache = checkAddressCollisions and {} or nil,
 		conditionsSatisfied = false,
 		returnValue = nil
 	}
@@ -46,43 +165,246 @@ function RandomExecutionTrace:new(computation, doRejectionInit)
 	self.__index = self
 
 	if doRejectionInit then
-		while not newobj.conditionsSatisfied do
-			util.cleartable(newobj.vars)
-			newobj:traceUpdate()
-		end
+		newobj:rejectionInitialize()
 	end
 
 	return newobj
 end
 
+-- Run the computation from scratch until all of its conditions are satisfied
+function RandomExecutionTrace:rejectionInitialize()
+	while not self.conditionsSatisfied do
+		self:clearVariables()
+		self:traceUpdate()
+	end
+end
+
+-- Forget all random variables, so that the next run samples them anew
+function RandomExecutionTrace:clearVariables()
+	self.vars = {}
+	self.sharesVars = false
+	self.freeStructural = NameSet:new()
+	self.freeNonstructural = NameSet:new()
+	self.sharesFreeVars = false
+end
+
+-- Copies are copy-on-write: the copy shares the variable tables and records
+-- of this trace, and whichever trace changes one of them first copies it.
+-- Until then, making and throwing away a copy allocates nothing per variable.
 function RandomExecutionTrace:deepcopy()
-	local newdb = RandomExecutionTrace:new(self.computation, false)
+	local newdb = RandomExecutionTrace:new(self.computation, false, self.random)
+	newdb.hashNames = self.hashNames
+	newdb.checkloopcounters = self.checkloopcounters and {} or nil
+	newdb.checkaddrcache = self.checkaddrcache and {} or nil
 	newdb.logprob = self.logprob
 	newdb.oldlogprob = self.oldlogprob
 	newdb.newlogprob = self.newlogprob
 	newdb.conditionsSatisfied = self.conditionsSatisfied
 	newdb.returnValue = self.returnValue
 
-	for i,v in ipairs(self.varlist) do
-		local newv = v:copy()
-		newdb.varlist[i] = newv
-		newdb.vars[v.name] = newv
+	-- Variables left in the flat list by a run that no longer reached them
+	-- come back in the copy (this is what copying the flat list always did)
+	if self.varsOutOfSync then
+		for i,rec in ipairs(self.varlist) do
+			local old = newdb.vars[rec.name]
+			newdb.vars[rec.name] = rec
+			newdb:moveFreeVar(rec.name, old and freeSetKey(old.structural, old.conditioned),
+							  freeSetKey(rec.structural, rec.conditioned))
+		end
+	else
+		newdb.vars = self.vars
+		newdb.sharesVars = true
+		self.sharesVars = true
+		newdb.freeStructural = self.freeStructural
+		newdb.freeNonstructural = self.freeNonstructural
+		newdb.sharesFreeVars = true
+		self.sharesFreeVars = true
 	end
+	newdb.varlist = self.varlist
+	newdb.sharesVarList = true
+	self.sharesVarList = true
+	newdb.checkpoints = self.checkpoints
+	newdb.sharesCheckpoints = true
+	self.sharesCheckpoints = true
+	-- This trace no longer owns its records, as the copy can see them too
+	self.id = newId()
 
 	return newdb
 end
 
+function RandomExecutionTrace:ownVars()
+	if self.sharesVars then
+		self.vars = util.copytable(self.vars)
+		self.sharesVars = false
+	end
+end
+
+function RandomExecutionTrace:ownFreeVars()
+	if self.sharesFreeVars then
+		self.freeStructural = self.freeStructural:copy()
+		self.freeNonstructural = self.freeNonstructural:copy()
+		self.sharesFreeVars = false
+	end
+end
+
+function RandomExecutionTrace:ownVarList()
+	if self.sharesVarList then
+		self.varlist = util.copytable(self.varlist)
+		self.sharesVarList = false
+	end
+end
+
+-- Return a version of 'record' that this trace may change in place,
+-- copying it if it is shared with other traces.
+-- 'index' is the record's position in the flat variable list (nil if
+-- unknown, false if the record is not in the list)
+function RandomExecutionTrace:ownRecord(record, index)
+	if record.owner == self.id then
+		return record
+	end
+	local newrec = record:copy()
+	newrec.owner = self.id
+	if self.vars[record.name] == record then
+		self:ownVars()
+		self:logWrite(self.vars, record.name)
+		self.vars[record.name] = newrec
+	end
+	if index == nil then
+		for i,rec in ipairs(self.varlist) do
+			if rec == record then
+				index = i
+				break
+			end
+		end
+	end
+	if index then
+		self:ownVarList()
+		self:logWrite(self.varlist, index)
+		self.varlist[index] = newrec
+	end
+	return newrec
+end
+
+-- Trace fields that in-place changes can reassign (saved by beginChanges)
+RandomExecutionTrace.undoFields = {
+	"vars", "varlist", "sharesVars", "sharesVarList", "varsOutOfSync", "id", "runid",
+	"freeStructural", "freeNonstructural", "sharesFreeVars",
+	"checkpoints", "sharesCheckpoints",
+	"currVarIndex", "logprob", "newlogprob", "oldlogprob", "conditionsSatisfied", "returnValue"
+}
+
+-- Start changing this trace in place. Until acceptChanges or rejectChanges
+-- is called, every write to a table that outlives the change (records, the
+-- variable tables) is recorded in an undo log, so rejectChanges can roll
+-- the trace back. The log is reused from one change to the next.
+-- (Loop counters and address caches are empty between runs, and 'active'
+--  marks are only read during a run, so neither needs to be logged.)
+function RandomExecutionTrace:beginChanges()
+	local log = self.undobuffer
+	if not log then
+		log = {n = 0, saved = {}}
+		self.undobuffer = log
+	end
+	log.n = 0
+	for i,field in ipairs(self.undoFields) do
+		log.saved[field] = self[field]
+	end
+	self.undolog = log
+end
+
+-- Record the current value of tbl[key] if we are keeping an undo log
+function RandomExecutionTrace:logWrite(tbl, key)
+	local log = self.undolog
+	if log then
+		local n = log.n
+		log[n+1] = tbl
+		log[n+2] = key
+		log[n+3] = tbl[key]
+		log.n = n + 3
+	end
+end
+
+function RandomExecutionTrace:acceptChanges()
+	self.undolog = nil
+end
+
+function RandomExecutionTrace:rejectChanges()
+	local log = self.undolog
+	self.undolog = nil
+	for i=log.n-2,1,-3 do
+		log[i][log[i+1]] = log[i+2]
+	end
+	for i,field in ipairs(self.undoFields) do
+		self[field] = log.saved[field]
+	end
+end
+
+-- Give the record 'var' (as returned by getRecord) a new value
+function RandomExecutionTrace:setVarValue(var, val)
+	self:logWrite(var, "val")
+	self:logWrite(var, "logprob")
+	var.val = val
+	var.logprob = var.erp:logprob(val, var.params)
+end
+
+-- Move the variable 'name' from the free set 'oldkey' to the free set
+-- 'newkey' (see freeSetKey; either may be nil)
+function RandomExecutionTrace:moveFreeVar(name, oldkey, newkey)
+	if oldkey ~= newkey then
+		self:ownFreeVars()
+		if oldkey then
+			self[oldkey]:remove(name, self)
+		end
+		if newkey then
+			self[newkey]:add(name, self)
+		end
+	end
+end
+
+-- Number of free variables of the given kinds (both by default)
+function RandomExecutionTrace:numFreeVars(structural, nonstructural)
+	local n = 0
+	if structural ~= false then
+		n = n + self.freeStructural.n
+	end
+	if nonstructural ~= false then
+		n = n + self.freeNonstructural.n
+	end
+	return n
+end
+
+-- Name of a free variable of the given kinds (both by default), chosen
+-- uniformly at random with the generator stream 'random' (nil if there
+-- are no such variables)
+function RandomExecutionTrace:randomFreeVarName(structural, nonstructural, random)
+	local ns = (structural ~= false) and self.freeStructural.n or 0
+	local nn = (nonstructural ~= false) and self.freeNonstructural.n or 0
+	if ns + nn == 0 then
+		return nil
+	end
+	local i = random(ns + nn)
+	if i <= ns then
+		return self.freeStructural.list[i]
+	else
+		return self.freeNonstructural.list[i - ns]
+	end
+end
+
 function RandomExecutionTrace:freeVarNames(structural, nonstructural)
-	structural = (structural == nil) and true or structural
-	nonstructural = (nonstructural == nil) and true or nonstructural
-	return util.keys(
-		util.filter(
-			function(rec)
-				return not rec.conditioned and
-						((structural and rec.structural) or
-						(nonstructural and not rec.structural))
-			end,
-			self.vars))
+	local names = {}
+	if structural ~= false then
+		local set = self.freeStructural
+		for i=1,set.n do
+			names[i] = set.list[i]
+		end
+	end
+	if nonstructural ~= false then
+		local set, n = self.freeNonstructural, table.getn(names)
+		for i=1,set.n do
+			names[n+i] = set.list[i]
+		end
+	end
+	return names
 end
 
 -- Names of variables that this trace has that the other does not
@@ -101,13 +423,27 @@ end
 function RandomExecutionTrace:lpDiff(other)
 	return util.sum(
 		util.map(
-			function(name) return self.vars[name].logprob end,
+			function(name) return self:readRecord(name).logprob end,
 			self:varDiff(other)))
 end
 
 -- The singleton trace object
 local trace = nil
 
+-- The address frame caches are only valid for the loop counters they
+-- were computed with, so they get cleared along with them
+-- (A trace whose addrcache is nil names its variables without the cache)
+function RandomExecutionTrace:clearLoopCounters()
+	util.cleartable(self.loopcounters)
+	if self.addrcache then
+		util.cleartable(self.addrcache)
+	end
+	if self.checkloopcounters then
+		util.cleartable(self.checkloopcounters)
+		util.cleartable(self.checkaddrcache)
+	end
+end
+
 -- Run computation and update this trace accordingly
 function RandomExecutionTrace:traceUpdate(structureIsFixed)
 
@@ -116,108 +452,250 @@ function RandomExecutionTrace:traceUpdate(structureIsFixed)
 
 	self.logprob = 0.0
 	self.newlogprob = 0.0
-	util.cleartable(self.loopcounters)
+	self:clearLoopCounters()
 	self.conditionsSatisfied = true
 	self.currVarIndex = 1
+	self.checkpointDepth = 0
 
 	-- If updating this trace can change the variable structure, then we
-	-- clear out the flat list of variables beforehand
+	-- start a new flat list of variables (the old one may be shared)
 	if not structureIsFixed then
-		util.cleartable(self.varlist)
+		self.varlist = {}
+		self.sharesVarList = false
+		self.varsOutOfSync = false
 	end
 
 	-- Mark all variables as inactive; only those reached
 	-- by the computation will become 'active'
-	for name,rec in pairs(self.vars) do
-		rec.active = false
-	end
+	self.runid = newId()
+	self:deactivateVariables()
 
 	-- Mark that this is the 'root' frame of the current execution trace
-	self.rootframe = debug.getinfo(1, 'p').fnprotoid
+	-- (debug.callsite can be compiled; it folds to a constant on-trace)
+	self.rootframe = debug.callsite()
 
 	-- Run the computation, which will create/lookup random variables
-	-- NOTE: Turning the JIT off like this is definitely safe (interpreter
-	--	stack will be preserved where we need it), but it may be overly
-	--  conservative (we may be able to turn the JIT back on at some parts...) 
-	--jit.off()
+	-- NOTE: This is safe to run with the JIT on. debug.getaddress is a plain
+	--  C function, so the trace recorder never compiles across it and it always
+	--  sees the full interpreter stack; only traces that reach it get aborted.
+	--  Lookups that hit the flat variable list never name anything.
 	self.returnValue = self.computation()
-	--jit.on()
 
 	-- Clean up
 	self.rootframe = nil
-	util.cleartable(self.loopcounters)
+	self:clearLoopCounters()
+
+	-- Clear out any random values and checkpoints that are no longer reachable
+	self.oldlogprob = self:removeInactiveVariables()
+	self:removeInactiveCheckpoints()
+	-- (If the structure was fixed after all, the unreached ones stay in the flat list)
+	if table.getn(self.varlist) >= self.currVarIndex then
+		self.varsOutOfSync = true
+	end
 
-	-- Clear out any random values that are no longer reachable
-	self.oldlogprob = 0.0
+	-- Reset the singleton trace
+	trace = origtrace
+end
+
+-- (Records are marked active with the id of the run that reaches them, so the
+--  new run id has already deactivated them all without touching shared records)
+function RandomExecutionTrace:deactivateVariables()
+end
+
+-- Remove the variables that the last run did not reach
+-- Returns their total log probability
+function RandomExecutionTrace:removeInactiveVariables()
+	local lp = 0.0
 	for name,rec in pairs(self.vars) do
-		if not rec.active then
-			self.oldlogprob = self.oldlogprob + rec.logprob
+		if rec.active ~= self.runid then
+			lp = lp + rec.logprob
+			self:ownVars()
+			self:logWrite(self.vars, name)
 			self.vars[name] = nil
+			self:moveFreeVar(name, freeSetKey(rec.structural, rec.conditioned), nil)
 		end
 	end
+	return lp
+end
 
-	-- Reset the singleton trace
-	trace = origtrace
+-- Checkpoints let a run skip deterministic work that an earlier run of this
+-- trace has already done: each one stores the arguments and results of a
+-- deterministic function under the structural name of its call site.
+-- (Lua cannot resume a copy of a coroutine, so a run always starts from the
+--  beginning of the computation; checkpoints are how it gets past the
+--  expensive, unchanged parts quickly.)
+
+local function pack(...)
+	return {n = select("#", ...), ...}
+end
+
+local function packsequal(p1, p2)
+	if p1.n ~= p2.n then
+		return false
+	end
+	for i=1,p1.n do
+		if p1[i] ~= p2[i] then
+			return false
+		end
+	end
+	return true
+end
+
+function RandomExecutionTrace:checkpoint(numFrameSkip, fn, ...)
+	local name = self:currentName(numFrameSkip+1)
+	local args = pack(...)
+	local entry = self.checkpoints[name]
+	if not entry or not packsequal(entry.args, args) then
+		self.checkpointDepth = self.checkpointDepth + 1
+		local results = pack(fn(...))
+		self.checkpointDepth = self.checkpointDepth - 1
+		entry = {args = args, results = results, active = nil}
+		self:ownCheckpoints()
+		self:logWrite(self.checkpoints, name)
+		self.checkpoints[name] = entry
+	end
+	entry.active = self.runid
+	return unpack(entry.results, 1, entry.results.n)
+end
+
+function RandomExecutionTrace:ownCheckpoints()
+	if self.sharesCheckpoints then
+		self.checkpoints = util.copytable(self.checkpoints)
+		self.sharesCheckpoints = false
+	end
+end
+
+function RandomExecutionTrace:removeInactiveCheckpoints()
+	for name,entry in pairs(self.checkpoints) do
+		if entry.active ~= self.runid then
+			self:ownCheckpoints()
+			self:logWrite(self.checkpoints, name)
+			self.checkpoints[name] = nil
+		end
+	end
 end
 
 -- Propose a random change to a random variable 'varname'
 -- Returns a new sample trace from the computation and the
 -- forward and reverse probabilities of this proposal
-function RandomExecutionTrace:proposeChange(varname, structureIsFixed)
+-- ('scale' multiplies the step size of drift kernels; default 1)
+function RandomExecutionTrace:proposeChange(varname, structureIsFixed, scale)
 	local nextTrace = self:deepcopy()
 	local var = nextTrace:getRecord(varname)
-	local propval = var.erp:proposal(var.val, var.params)
-	local fwdPropLP = var.erp:logProposalProb(var.val, propval, var.params)
-	local rvsPropLP = var.erp:logProposalProb(propval, var.val, var.params)
-	var.val = propval
-	var.logprob = var.erp:logprob(var.val, var.params)
+	local propval = var.erp:proposal(var.val, var.params, self.random, scale)
+	local fwdPropLP = var.erp:logProposalProb(var.val, propval, var.params, scale)
+	local rvsPropLP = var.erp:logProposalProb(propval, var.val, var.params, scale)
+	nextTrace:setVarValue(var, propval)
+	nextTrace:traceUpdate(structureIsFixed)
+	fwdPropLP = fwdPropLP + nextTrace.newlogprob
+	rvsPropLP = rvsPropLP + nextTrace.oldlogprob
+	return nextTrace, fwdPropLP, rvsPropLP
+end
+
+-- Like proposeChange, but changes this trace instead of a copy of it.
+-- Returns the forward and reverse probabilities of the proposal; the caller
+-- must then either acceptChanges or rejectChanges
+function RandomExecutionTrace:proposeChangeInPlace(varname, structureIsFixed, scale)
+	self:beginChanges()
+	local var = self:getRecord(varname)
+	local propval = var.erp:proposal(var.val, var.params, self.random, scale)
+	local fwdPropLP = var.erp:logProposalProb(var.val, propval, var.params, scale)
+	local rvsPropLP = var.erp:logProposalProb(propval, var.val, var.params, scale)
+	self:setVarValue(var, propval)
+	self:traceUpdate(structureIsFixed)
+	fwdPropLP = fwdPropLP + self.newlogprob
+	rvsPropLP = rvsPropLP + self.oldlogprob
+	return fwdPropLP, rvsPropLP
+end
+
+-- Give each variable in 'varnames' a proposed value, without running the
+-- computation ('scales[i]' is the step size multiplier for varnames[i])
+-- Returns the forward and reverse probabilities of the proposed values
+local function proposeValues(tr, varnames, scales)
+	local fwdPropLP, rvsPropLP = 0, 0
+	for i=1,table.getn(varnames) do
+		local var = tr:getRecord(varnames[i])
+		local scale = scales and scales[i]
+		local propval = var.erp:proposal(var.val, var.params, tr.random, scale)
+		fwdPropLP = fwdPropLP + var.erp:logProposalProb(var.val, propval, var.params, scale)
+		rvsPropLP = rvsPropLP + var.erp:logProposalProb(propval, var.val, var.params, scale)
+		tr:setVarValue(var, propval)
+	end
+	return fwdPropLP, rvsPropLP
+end
+
+-- Like proposeChange, but changes all the variables in 'varnames' at once,
+-- with a single run of the computation
+function RandomExecutionTrace:proposeBlockChange(varnames, structureIsFixed, scales)
+	local nextTrace = self:deepcopy()
+	local fwdPropLP, rvsPropLP = proposeValues(nextTrace, varnames, scales)
 	nextTrace:traceUpdate(structureIsFixed)
 	fwdPropLP = fwdPropLP + nextTrace.newlogprob
 	rvsPropLP = rvsPropLP + nextTrace.oldlogprob
 	return nextTrace, fwdPropLP, rvsPropLP
 end
 
--- local logfile = io.open("log.csv", "w")
--- local iteration = 0
--- logfile:write("iteration,numframes\n")
+-- Like proposeBlockChange, but in place, as for proposeChangeInPlace
+function RandomExecutionTrace:proposeBlockChangeInPlace(varnames, structureIsFixed, scales)
+	self:beginChanges()
+	local fwdPropLP, rvsPropLP = proposeValues(self, varnames, scales)
+	self:traceUpdate(structureIsFixed)
+	fwdPropLP = fwdPropLP + self.newlogprob
+	rvsPropLP = rvsPropLP + self.oldlogprob
+	return fwdPropLP, rvsPropLP
+end
+
+-- The log probability this trace would have if the non-structural variable
+-- 'varname' had the value 'val' (-math.huge if that violates a condition)
+-- The trace is left as it was.
+function RandomExecutionTrace:scoreValue(varname, val)
+	self:beginChanges()
+	self:setVarValue(self:getRecord(varname), val)
+	self:traceUpdate(true)
+	local lp = self.conditionsSatisfied and self.logprob or -math.huge
+	self:rejectChanges()
+	return lp
+end
 
 -- Return the current structural name, as determined by the interpreter stack
+-- (The frame walk, loop counting and name building all happen in one call to
+--  debug.getaddress; see lj_debug_address in the modified LuaJIT. The frame
+--  cache lets it reuse the name prefix and loop counts of every frame that is
+--  unchanged since the previous call, so only the frames that were entered
+--  since then cost more than a pointer walk.)
 function RandomExecutionTrace:currentName(numFrameSkip)
-	
-	-- Get list of frames from the root frame to the current frame
-	local i = 2 + numFrameSkip
-	local flst = {}
-	local f = nil
-	repeat
-		f = debug.getinfo(i, 'p')
-		table.insert(flst, 1, f)
-		i = i + 1
-	until not f or (self.rootframe and f.fnprotoid == self.rootframe)
-	-- logfile:write(iteration .. "," .. table.getn(flst) .. "\n")
-	-- iteration = iteration + 1
-
-	-- Build up name string, checking loop counters along the way
-	local name = ""
-	for i=1,table.getn(flst)-1 do
-		f = flst[i]
-		name = string.format("%s%d:%d", name, f.fnprotoid, f.bytecodepos)
-		local loopnum = self.loopcounters[name] or 0
-		name = string.format("%s:%d|", name, loopnum)
-	end
-	-- For the last (topmost frame), also increment the loop counter
-	f = flst[table.getn(flst)]
-	name = string.format("%s%d:%d", name, f.fnprotoid, f.bytecodepos)
-	local loopnum = self.loopcounters[name] or 0
-	self.loopcounters[name] = loopnum + 1
-	name = string.format("%s:%d|", name, loopnum)
-
-	return name
+	-- Both calls below are tail calls, so they see the same stack we do
+	if self.checkloopcounters then
+		return self:checkedHashName(numFrameSkip)
+	end
+	-- Level is 1 + numFrameSkip instead of 2 + numFrameSkip because this is a tail call
+	return debug.getaddress(1 + numFrameSkip, self.rootframe, self.loopcounters,
+							self.hashNames, self.addrcache)
+end
+
+-- Hashed name for the current address, checked against its string name
+-- (Keeps a separate set of string-keyed loop counters to compute the latter)
+function RandomExecutionTrace:checkedHashName(numFrameSkip)
+	local h = debug.getaddress(2 + numFrameSkip, self.rootframe, self.loopcounters, true,
+							   self.addrcache)
+	local s = debug.getaddress(2 + numFrameSkip, self.rootframe, self.checkloopcounters, false,
+							   self.checkaddrcache)
+	local prev = hashedAddressNames[h]
+	if prev and prev ~= s then
+		error(string.format("Address hash collision: '%s' and '%s' both hash to %.17g", prev, s, h))
+	end
+	hashedAddressNames[h] = s
+	return h
 end
 
 -- Looks up the value of a random variable.
 -- Creates the variable if it does not already exist
-function RandomExecutionTrace:lookup(erp, params, numFrameSkip, isStructural, conditionedValue)
+-- (ERPs with at most two scalar parameters pass them as p1 and p2, with
+--  'params' nil; then a parameter table is only made for the record when
+--  the variable is created or its parameters change)
+function RandomExecutionTrace:lookup(erp, params, numFrameSkip, isStructural, conditionedValue, p1, p2)
 
+	local scalar = (params == nil)
 	local record = nil
 	local name = nil
 	-- Try to find the variable (first check the flat list, then do slower name lookup)
@@ -233,41 +711,88 @@ function RandomExecutionTrace:lookup(erp, params, numFrameSkip, isStructural, co
 	end
 	-- If we didn't find the variable, create a new one
 	if not record then
-		local val = conditionedValue or erp:sample_impl(params)
-		local ll = erp:logprob(val, params)
+		local val, ll
+		if params then
+			val = conditionedValue or erp:sample_impl(params, self.random)
+			ll = erp:logprob(val, params)
+		else
+			val = conditionedValue or erp:sampleArgs(self.random, p1, p2)
+			ll = erp:logprobArgs(val, p1, p2)
+			params = {p1, p2}
+		end
 		self.newlogprob  = self.newlogprob + ll
 		record = RandomVariableRecord:new(name, erp, params, val, ll, isStructural, conditionedValue ~= nil)
+		record.owner = self.id
+		local old = self.vars[name]
+		self:ownVars()
+		self:logWrite(self.vars, name)
 		self.vars[name] = record
+		self:moveFreeVar(name, old and freeSetKey(old.structural, old.conditioned),
+						 freeSetKey(isStructural, conditionedValue ~= nil))
 	-- Otherwise, reuse the variable we found, but check if its parameters/conditioning
-	-- status have changed
+	-- status have changed (the record only gets copied if they have)
 	else
-		record.conditioned = (conditionedValue ~= nil)
-		hasChanges = false
-		if not util.arrayequals(record.params, params) then
-			record.params = params
-			hasChanges = true
+		local conditioned = (conditionedValue ~= nil)
+		local paramsChanged
+		if params then
+			paramsChanged = not util.arrayequals(record.params, params)
+		else
+			local rp = record.params
+			paramsChanged = rp[1] ~= p1 or rp[2] ~= p2
+			params = paramsChanged and {p1, p2} or rp
 		end
-		if conditionedValue and conditionedValue ~= record.val then
-			record.val = conditionedValue
-			record.conditioned = true
-			hasChanges = true
-		end
-		if hasChanges then
-			record.logprob = erp:logprob(record.val, params)
+		local valChanged = conditionedValue and conditionedValue ~= record.val
+		if paramsChanged or valChanged or conditioned ~= record.conditioned then
+			-- Records found by name are never in the flat list yet
+			record = self:ownRecord(record, varIsInFlatList and self.currVarIndex or false)
+			if conditioned ~= record.conditioned and self.vars[record.name] == record then
+				self:moveFreeVar(record.name, freeSetKey(record.structural, record.conditioned),
+								 freeSetKey(record.structural, conditioned))
+			end
+			self:logWrite(record, "conditioned")
+			record.conditioned = conditioned
+			if paramsChanged then
+				self:logWrite(record, "params")
+				record.params = params
+			end
+			if valChanged then
+				self:logWrite(record, "val")
+				record.val = conditionedValue
+			end
+			if paramsChanged or valChanged then
+				self:logWrite(record, "logprob")
+				record.logprob = scalar and erp:logprobArgs(record.val, p1, p2) or erp:logprob(record.val, params)
+			end
 		end
 	end
 	-- Finish up and return
 	if not varIsInFlatList then
+		self:ownVarList()
+		self:logWrite(self.varlist, table.getn(self.varlist)+1)
 		table.insert(self.varlist, record)
 	end
 	self.currVarIndex = self.currVarIndex + 1
 	self.logprob = self.logprob + record.logprob
-	record.active = true
+	record.active = self.runid
 	return record.val
 end
 
--- Simply retrieve the variable record associated with 'name'
+-- The value of the variable 'name' (nil if the trace has no such variable)
+function RandomExecutionTrace:varValue(name)
+	local record = self.vars[name]
+	return record and record.val
+end
+
+-- Retrieve the variable record associated with 'name', ready to be changed
 function RandomExecutionTrace:getRecord(name)
+	local record = self.vars[name]
+	return record and self:ownRecord(record)
+end
+
+-- Retrieve the variable record associated with 'name', for reading only
+-- (The record may be shared with other traces, so it must not be changed;
+--  unlike getRecord, this never copies it)
+function RandomExecutionTrace:readRecord(name)
 	return self.vars[name]
 end
 
@@ -283,29 +808,520 @@ end
 
 
 
+-- Execution trace that keeps its variables in parallel FFI arrays
+-- (struct-of-arrays) instead of one RandomVariableRecord table per variable.
+-- Every variable gets a slot; numeric values, log probabilities and flags
+-- live inline in the arrays, while names, ERPs, parameters and non-numeric
+-- values live in plain Lua tables indexed by slot. Copying a trace memcpy's
+-- the arrays and shares the Lua tables until one of the copies writes to them.
+local FFIRandomExecutionTrace = setmetatable({}, {__index = RandomExecutionTrace})
+
+FFIRandomExecutionTrace.undoFields = {
+	"vars", "varlist", "sharesVars", "sharesVarList", "varsOutOfSync", "id", "runid",
+	"checkpoints", "sharesCheckpoints",
+	"currVarIndex", "logprob", "newlogprob", "oldlogprob", "conditionsSatisfied", "returnValue",
+	"names", "erps", "params", "boxed", "propstats", "freeslots", "sharesTables",
+	"freeStructural", "freeNonstructural",
+	"numslots", "capacity", "vals", "logprobs", "flags"
+}
+
+-- Slot flags
+local SLOT_USED = 1
+local SLOT_ACTIVE = 2
+local SLOT_STRUCTURAL = 4
+local SLOT_CONDITIONED = 8
+local SLOT_BOXED = 16		-- value is not a number and lives in 'boxed'
+
+local function slotFreeSetKey(f)
+	return freeSetKey(band(f, SLOT_STRUCTURAL) ~= 0, band(f, SLOT_CONDITIONED) ~= 0)
+end
+
+function FFIRandomExecutionTrace:new(computation, doRejectionInit, random)
+	doRejectionInit = (doRejectionInit == nil) and true or doRejectionInit
+	local newobj = RandomExecutionTrace.new(self, computation, false, random)
+	newobj.numslots = 0
+	newobj:allocSlots(16)
+	newobj:resetSlotTables()
+
+	if doRejectionInit then
+		newobj:rejectionInitialize()
+	end
+
+	return newobj
+end
+
+-- (Re)allocate the slot arrays, keeping the contents of the used slots
+-- Slots are numbered from 1, so that they can index Lua arrays as well
+function FFIRandomExecutionTrace:allocSlots(capacity)
+	local vals = ffi.new("double[?]", capacity+1)
+	local logprobs = ffi.new("double[?]", capacity+1)
+	local flags = ffi.new("uint8_t[?]", capacity+1)
+	if self.vals then
+		local n = self.numslots + 1
+		ffi.copy(vals, self.vals, n*ffi.sizeof("double"))
+		ffi.copy(logprobs, self.logprobs, n*ffi.sizeof("double"))
+		ffi.copy(flags, self.flags, n)
+	end
+	self.vals = vals
+	self.logprobs = logprobs
+	self.flags = flags
+	self.capacity = capacity
+end
+
+function FFIRandomExecutionTrace:resetSlotTables()
+	self.vars = {}			-- name -> slot
+	self.varlist = {}		-- execution order -> slot
+	self.names = {}
+	self.erps = {}
+	self.params = {}
+	self.boxed = {}
+	self.propstats = {}
+	self.freeslots = {}
+	self.freeStructural = NameSet:new()
+	self.freeNonstructural = NameSet:new()
+	self.sharesTables = false
+end
+
+-- Give this trace its own copies of the slot tables before writing to them
+function FFIRandomExecutionTrace:ownTables()
+	if self.sharesTables then
+		self.vars = util.copytable(self.vars)
+		self.varlist = util.copytable(self.varlist)
+		self.names = util.copytable(self.names)
+		self.erps = util.copytable(self.erps)
+		self.params = util.copytable(self.params)
+		self.boxed = util.copytable(self.boxed)
+		self.propstats = util.copytable(self.propstats)
+		self.freeslots = util.copytable(self.freeslots)
+		self.freeStructural = self.freeStructural:copy()
+		self.freeNonstructural = self.freeNonstructural:copy()
+		self.sharesTables = false
+	end
+end
+
+-- (The free variable index is one of the slot tables)
+FFIRandomExecutionTrace.ownFreeVars = FFIRandomExecutionTrace.ownTables
+
+function FFIRandomExecutionTrace:deepcopy()
+	local newdb = RandomExecutionTrace.new(FFIRandomExecutionTrace, self.computation, false, self.random)
+	newdb.hashNames = self.hashNames
+	newdb.checkloopcounters = self.checkloopcounters and {} or nil
+	newdb.checkaddrcache = self.checkaddrcache and {} or nil
+	newdb.logprob = self.logprob
+	newdb.oldlogprob = self.oldlogprob
+	newdb.newlogprob = self.newlogprob
+	newdb.conditionsSatisfied = self.conditionsSatisfied
+	newdb.returnValue = self.returnValue
+
+	newdb.numslots = self.numslots
+	newdb:allocSlots(self.capacity)
+	local n = self.numslots + 1
+	ffi.copy(newdb.vals, self.vals, n*ffi.sizeof("double"))
+	ffi.copy(newdb.logprobs, self.logprobs, n*ffi.sizeof("double"))
+	ffi.copy(newdb.flags, self.flags, n)
+
+	if self.varsOutOfSync then
+		newdb.vars = {}
+		for i,slot in ipairs(self.varlist) do
+			local name = self.names[slot]
+			local old = newdb.vars[name]
+			newdb.vars[name] = slot
+			newdb:moveFreeVar(name, old and slotFreeSetKey(self.flags[old]), slotFreeSetKey(self.flags[slot]))
+		end
+	else
+		newdb.vars = self.vars
+		newdb.freeStructural = self.freeStructural
+		newdb.freeNonstructural = self.freeNonstructural
+	end
+	newdb.varlist = self.varlist
+	newdb.names = self.names
+	newdb.erps = self.erps
+	newdb.params = self.params
+	newdb.boxed = self.boxed
+	newdb.propstats = self.propstats
+	newdb.freeslots = self.freeslots
+	newdb.sharesTables = true
+	self.sharesTables = true
+	newdb.checkpoints = self.checkpoints
+	newdb.sharesCheckpoints = true
+	self.sharesCheckpoints = true
+
+	return newdb
+end
+
+function FFIRandomExecutionTrace:clearVariables()
+	self.numslots = 0
+	self:resetSlotTables()
+end
+
+function FFIRandomExecutionTrace:slotValue(slot)
+	if band(self.flags[slot], SLOT_BOXED) ~= 0 then
+		return self.boxed[slot]
+	else
+		return self.vals[slot]
+	end
+end
+
+function FFIRandomExecutionTrace:setSlotValue(slot, val)
+	local flags = self.flags
+	if type(val) == "number" then
+		if band(flags[slot], SLOT_BOXED) ~= 0 then
+			self:ownTables()
+			self:logWrite(self.boxed, slot)
+			self.boxed[slot] = nil
+			self:logWrite(flags, slot)
+			flags[slot] = band(flags[slot], bnot(SLOT_BOXED))
+		end
+		self:logWrite(self.vals, slot)
+		self.vals[slot] = val
+	else
+		self:ownTables()
+		self:logWrite(self.boxed, slot)
+		self.boxed[slot] = val
+		self:logWrite(flags, slot)
+		flags[slot] = bor(flags[slot], SLOT_BOXED)
+	end
+end
+
+-- Change the conditioned flag of a slot, keeping the free variable index
+-- in step
+function FFIRandomExecutionTrace:setSlotConditioned(slot, conditioned)
+	local f = self.flags[slot]
+	local name = self.names[slot]
+	if self.vars[name] == slot then
+		self:moveFreeVar(name, slotFreeSetKey(f), freeSetKey(band(f, SLOT_STRUCTURAL) ~= 0, conditioned))
+	end
+	self:setSlotFlag(slot, SLOT_CONDITIONED, conditioned)
+end
+
+function FFIRandomExecutionTrace:setSlotFlag(slot, flag, on)
+	self:logWrite(self.flags, slot)
+	if on then
+		self.flags[slot] = bor(self.flags[slot], flag)
+	else
+		self.flags[slot] = band(self.flags[slot], bnot(flag))
+	end
+end
+
+-- Set a slot's entry in one of the slot tables or arrays
+function FFIRandomExecutionTrace:setSlotEntry(tbl, slot, v)
+	self:logWrite(tbl, slot)
+	tbl[slot] = v
+end
+
+-- Grab a free slot and fill it in (does not touch 'vars' or 'varlist')
+function FFIRandomExecutionTrace:newSlot(name, erp, params, val, logprob, structural, conditioned)
+	self:ownTables()
+	local numfree = table.getn(self.freeslots)
+	local slot = nil
+	if numfree > 0 then
+		slot = self.freeslots[numfree]
+		self:setSlotEntry(self.freeslots, numfree, nil)
+	else
+		slot = self.numslots + 1
+		if slot > self.capacity then
+			self:allocSlots(2*self.capacity)
+		end
+		self.numslots = slot
+	end
+	self:setSlotEntry(self.names, slot, name)
+	self:setSlotEntry(self.erps, slot, erp)
+	self:setSlotEntry(self.params, slot, params)
+	self:setSlotEntry(self.propstats, slot, newProposalStats(erp))
+	self:setSlotEntry(self.flags, slot, bor(SLOT_USED, SLOT_ACTIVE,
+											structural and SLOT_STRUCTURAL or 0,
+											conditioned and SLOT_CONDITIONED or 0))
+	self:setSlotValue(slot, val)
+	self:setSlotEntry(self.logprobs, slot, logprob)
+	return slot
+end
+
+function FFIRandomExecutionTrace:freeSlot(slot)
+	self:ownTables()
+	self:setSlotEntry(self.flags, slot, 0)
+	self:setSlotEntry(self.names, slot, nil)
+	self:setSlotEntry(self.erps, slot, nil)
+	self:setSlotEntry(self.params, slot, nil)
+	self:setSlotEntry(self.boxed, slot, nil)
+	self:setSlotEntry(self.propstats, slot, nil)
+	self:setSlotEntry(self.freeslots, table.getn(self.freeslots)+1, slot)
+end
+
+function FFIRandomExecutionTrace:deactivateVariables()
+	local flags = self.flags
+	for slot=1,self.numslots do
+		flags[slot] = band(flags[slot], bnot(SLOT_ACTIVE))
+	end
+end
+
+function FFIRandomExecutionTrace:removeInactiveVariables()
+	-- Slots that stay in the flat list past the end of this run are kept
+	local keep = nil
+	for i=self.currVarIndex,table.getn(self.varlist) do
+		keep = keep or {}
+		keep[self.varlist[i]] = true
+	end
+	local flags = self.flags
+	local lp = 0.0
+	for slot=1,self.numslots do
+		if band(flags[slot], SLOT_USED + SLOT_ACTIVE) == SLOT_USED then
+			local name = self.names[slot]
+			if self.vars[name] == slot then
+				lp = lp + self.logprobs[slot]
+				self:ownTables()
+				self:setSlotEntry(self.vars, name, nil)
+				self:moveFreeVar(name, slotFreeSetKey(flags[slot]), nil)
+			end
+			if not (keep and keep[slot]) then
+				self:freeSlot(slot)
+			end
+		end
+	end
+	return lp
+end
+
+function FFIRandomExecutionTrace:lookup(erp, params, numFrameSkip, isStructural, conditionedValue, p1, p2)
+
+	local scalar = (params == nil)
+	local flags = self.flags
+	local slot = nil
+	local name = nil
+	-- Try to find the variable (first check the flat list, then do slower name lookup)
+	local varIsInFlatList = self.currVarIndex <= table.getn(self.varlist)
+	if varIsInFlatList then
+		slot = self.varlist[self.currVarIndex]
+	else
+		name = self:currentName(numFrameSkip+1)
+		slot = self.vars[name]
+		if slot and (self.erps[slot] ~= erp or not isStructural ~= (band(flags[slot], SLOT_STRUCTURAL) == 0)) then
+			-- The new variable replaces this one, just like it would in a RandomExecutionTrace
+			self:moveFreeVar(name, slotFreeSetKey(flags[slot]), nil)
+			self:freeSlot(slot)
+			slot = nil
+		end
+	end
+	-- If we didn't find the variable, create a new one
+	if not slot then
+		local val, ll
+		if params then
+			val = conditionedValue or erp:sample_impl(params, self.random)
+			ll = erp:logprob(val, params)
+		else
+			val = conditionedValue or erp:sampleArgs(self.random, p1, p2)
+			ll = erp:logprobArgs(val, p1, p2)
+			params = {p1, p2}
+		end
+		self.newlogprob  = self.newlogprob + ll
+		slot = self:newSlot(name, erp, params, val, ll, isStructural, conditionedValue ~= nil)
+		self:setSlotEntry(self.vars, name, slot)
+		self:moveFreeVar(name, nil, freeSetKey(isStructural, conditionedValue ~= nil))
+		flags = self.flags
+	-- Otherwise, reuse the variable we found, but check if its parameters/conditioning
+	-- status have changed
+	else
+		local conditioned = (conditionedValue ~= nil)
+		if conditioned ~= (band(flags[slot], SLOT_CONDITIONED) ~= 0) then
+			self:setSlotConditioned(slot, conditioned)
+		end
+		local hasChanges = false
+		local paramsChanged
+		if params then
+			paramsChanged = not util.arrayequals(self.params[slot], params)
+		else
+			local sp = self.params[slot]
+			paramsChanged = sp[1] ~= p1 or sp[2] ~= p2
+			params = paramsChanged and {p1, p2} or sp
+		end
+		if paramsChanged then
+			self:ownTables()
+			self:setSlotEntry(self.params, slot, params)
+			hasChanges = true
+		end
+		if conditionedValue and conditionedValue ~= self:slotValue(slot) then
+			self:setSlotValue(slot, conditionedValue)
+			hasChanges = true
+		end
+		if hasChanges then
+			local val = self:slotValue(slot)
+			self:setSlotEntry(self.logprobs, slot, scalar and erp:logprobArgs(val, p1, p2) or erp:logprob(val, params))
+		end
+	end
+	-- Finish up and return
+	if not varIsInFlatList then
+		self:ownTables()
+		self:setSlotEntry(self.varlist, table.getn(self.varlist)+1, slot)
+	end
+	self.currVarIndex = self.currVarIndex + 1
+	self.logprob = self.logprob + self.logprobs[slot]
+	flags[slot] = bor(flags[slot], SLOT_ACTIVE)
+	return self:slotValue(slot)
+end
+
+-- Stand-in for the RandomVariableRecord of a slot; reads and writes go
+-- straight to the trace's arrays
+local FFIRecordView = {}
+
+local slotGetters =
+{
+	name = function(tr, slot) return tr.names[slot] end,
+	erp = function(tr, slot) return tr.erps[slot] end,
+	params = function(tr, slot) return tr.params[slot] end,
+	val = function(tr, slot) return tr:slotValue(slot) end,
+	logprob = function(tr, slot) return tr.logprobs[slot] end,
+	structural = function(tr, slot) return band(tr.flags[slot], SLOT_STRUCTURAL) ~= 0 end,
+	conditioned = function(tr, slot) return band(tr.flags[slot], SLOT_CONDITIONED) ~= 0 end,
+	proposalStats = function(tr, slot) return tr.propstats[slot] end
+}
+
+local slotSetters =
+{
+	params = function(tr, slot, v) tr:ownTables(); tr:setSlotEntry(tr.params, slot, v) end,
+	val = function(tr, slot, v) tr:setSlotValue(slot, v) end,
+	logprob = function(tr, slot, v) tr:setSlotEntry(tr.logprobs, slot, v) end,
+	conditioned = function(tr, slot, v) tr:setSlotConditioned(slot, v) end
+}
+
+function FFIRecordView:__index(k)
+	local get = slotGetters[k]
+	return get and get(self.trace, self.slot)
+end
+
+function FFIRecordView:__newindex(k, v)
+	local set = slotSetters[k]
+	if not set then
+		error("Cannot set field '" .. tostring(k) .. "' of a random variable record")
+	end
+	set(self.trace, self.slot, v)
+end
+
+function FFIRandomExecutionTrace:varValue(name)
+	local slot = self.vars[name]
+	return slot and self:slotValue(slot)
+end
+
+function FFIRandomExecutionTrace:getRecord(name)
+	local slot = self.vars[name]
+	return slot and setmetatable({trace = self, slot = slot}, FFIRecordView)
+end
+
+-- (Views never copy anything, so reading through one is just as cheap)
+FFIRandomExecutionTrace.readRecord = FFIRandomExecutionTrace.getRecord
+
+function FFIRandomExecutionTrace:setVarValue(var, val)
+	local slot = var.slot
+	self:setSlotValue(slot, val)
+	self:setSlotEntry(self.logprobs, slot, self.erps[slot]:logprob(val, self.params[slot]))
+end
+
+
+-- Which class newTrace uses
+local traceClass = RandomExecutionTrace
+
+-- Switch between 'table' storage (one RandomVariableRecord per variable)
+-- and 'ffi' storage (FFIRandomExecutionTrace) for traces created from now on
+function setStorageMode(mode)
+	assert(mode == "table" or mode == "ffi", "Unknown storage mode " .. tostring(mode))
+	traceClass = (mode == "ffi") and FFIRandomExecutionTrace or RandomExecutionTrace
+end
+
+-- The current address mode, collision checking flag and storage mode
+-- (in the form accepted by setAddressMode and setStorageMode)
+function getModes()
+	return hashAddresses and "hash" or "string", checkAddressCollisions,
+		   (traceClass == FFIRandomExecutionTrace) and "ffi" or "table"
+end
+
+
+
 -- Exported functions for interacting with the singleton trace
 
 function lookupVariableValue(erp, params, isStructural, numFrameSkip, conditionedValue)
 	if not trace then
-		return conditionedValue or erp:sample_impl(params)
+		return conditionedValue or erp:sample_impl(params, math.random)
+	elseif trace.checkpointDepth > 0 then
+		error("Checkpointed functions must be deterministic")
 	else
 		-- We don't do numFrameSkip + 1 because this is a tail call
 		return trace:lookup(erp, params, numFrameSkip, isStructural, conditionedValue)
 	end
 end
 
+-- Like lookupVariableValue, for ERPs with at most two scalar parameters,
+-- which are passed directly instead of in a table
+function lookupScalarVariableValue(erp, p1, p2, isStructural, numFrameSkip, conditionedValue)
+	if not trace then
+		return conditionedValue or erp:sampleArgs(math.random, p1, p2)
+	elseif trace.checkpointDepth > 0 then
+		error("Checkpointed functions must be deterministic")
+	else
+		-- We don't do numFrameSkip + 1 because this is a tail call
+		return trace:lookup(erp, nil, numFrameSkip, isStructural, conditionedValue, p1, p2)
+	end
+end
+
+-- The new trace gets its own generator stream, split off the stream of
+-- the trace being run (for nested queries) or else off math.random
 function newTrace(computation)
-	return RandomExecutionTrace:new(computation)
+	return traceClass:new(computation, true, math.splitrandom(trace and trace.random or math.random))
 end
 
 function factor(num)
 	if trace then
+		assert(trace.checkpointDepth == 0, "Checkpointed functions cannot add factors")
 		trace:addFactor(num)
 	end
 end
 
 function condition(boolexpr)
 	if trace then
+		assert(trace.checkpointDepth == 0, "Checkpointed functions cannot add conditions")
 		trace:conditionOn(boolexpr)
 	end
+end
+
+-- Call the deterministic function 'fn' with the given arguments. When the
+-- trace is re-run and reaches this call again with the same arguments
+-- (compared with ==), the results are reused instead of calling 'fn'.
+-- 'fn' must not make random choices, add factors or conditions, and
+-- anything it depends on besides its arguments must not change between
+-- runs. Callers must not modify the results it returns.
+function checkpoint(fn, ...)
+	if not trace then
+		return fn(...)
+	else
+		-- We don't do numFrameSkip + 1 because this is a tail call
+		return trace:checkpoint(0, fn, ...)
+	end
+end
+
+-- Add the factor fn(...) into the log-likelihood of the trace, like
+-- factor(fn(...)), but only call 'fn' again on re-runs if its arguments
+-- have changed. Passing the random values a factor depends on as arguments
+-- (instead of reading them through upvalues) lets a proposal recompute
+-- just the factors that depend on the variables it changed.
+-- 'fn' has the same restrictions as for checkpoint.
+function cachedFactor(fn, ...)
+	if trace then
+		-- numFrameSkip is 1 because this is not a tail call
+		trace:addFactor(trace:checkpoint(1, fn, ...))
+	end
+end
+
+local function observedLogprob(erp, data, n, ...)
+	return erp:logprobBatch(data, {...}, n)
+end
+
+-- Condition the trace on the first 'n' values in 'data' (a Lua array or an
+-- FFI double array; 'n' defaults to #data) having been drawn independently
+-- from the ERP 'erp' (see erp.primitives) with parameters 'params'.
+-- The whole dataset adds a single factor, scored in one batched call and
+-- cached like a cachedFactor, so it is only rescored on re-runs when the
+-- parameters (or the data array itself) change. The values in 'data' must
+-- not be changed in place between runs.
+function observe(erp, params, data, n)
+	if trace then
+		assert(trace.checkpointDepth == 0, "Checkpointed functions cannot add factors")
+		-- numFrameSkip is 1 because this is not a tail call
+		trace:addFactor(trace:checkpoint(1, observedLogprob, erp, data, n, unpack(params)))
+	end
 end
\ No newline at end of file
@@ -2,11 +2,34 @@
 module(..., package.seeall)
 
 
+-- (Erp vectors are cdata, which pairs and ipairs cannot walk, so map,
+--  filter, sum and arrayequals step through them by index instead)
+local function vectornext(v, i)
+	i = i + 1
+	if i <= #v then
+		return i, v[i]
+	end
+end
+
+local function elements(tbl)
+	if type(tbl) == "cdata" then
+		return vectornext, tbl, 0
+	end
+	return pairs(tbl)
+end
+
+local function ielements(tbl)
+	if type(tbl) == "cdata" then
+		return vectornext, tbl, 0
+	end
+	return ipairs(tbl)
+end
+
 -- map(function, table)
 -- e.g: map(double, {1,2,3})    -> {2,4,6}
 function map(func, tbl)
 	local newtbl = {}
-	for i,v in pairs(tbl) do
+	for i,v in elements(tbl) do
 		newtbl[i] = func(v)
 	end
 	return newtbl
@@ -16,7 +39,7 @@ end
 -- e.g: filter(is_even, {1,2,3,4}) -> {2,4}
 function filter(func, tbl)
 	local newtbl= {}
-	for i,v in pairs(tbl) do
+	for i,v in elements(tbl) do
 		if func(v) then
 			newtbl[i]=v
 		end
@@ -34,17 +57,19 @@ end
 
 function sum(tab)
 	local s = 0
-	for k,v in pairs(tab) do
+	for k,v in elements(tab) do
 		s = s + v
 	end
 	return s
 end
 
 function arrayequals(a1, a2)
-	if table.getn(a1) ~= table.getn(a2) then
+	if a1 == a2 then
+		return true
+	elseif #a1 ~= #a2 then
 		return false
 	else
-		for i,v in ipairs(a1) do
+		for i,v in ielements(a1) do
 			if v ~= a2[i] then
 				return false
 			end
@@ -58,7 +83,7 @@ function cleartable(tab)
 end
 
 function copytable(tab)
-	newtbl = {}
+	local newtbl = {}
 	for k,v in pairs(tab) do
 		newtbl[k] = v
 	end
@@ -71,10 +96,12 @@ function copytablemembers(srctab, dsttab)
 	end
 end
 
-function randomChoice(tbl)
+-- (Draws from the generator stream 'random', if given, else math.random)
+function randomChoice(tbl, random)
+	random = random or math.random
 	local n = table.getn(tbl)
 	if n > 0 then
-		return tbl[math.random(n)]
+		return tbl[random(n)]
 	else
 		return nil
 	end